@@ -0,0 +1,38 @@
+import os
+import sys
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import numpy as np
+import torchslide as ts
+
+
+def bench(image, level_scale, workers, tile=512, count=512, seed=0):
+    h, w, *_ = image.shape
+    rng = np.random.RandomState(seed)
+    ys = rng.randint(0, max(h - tile * level_scale, 1), count)
+    xs = rng.randint(0, max(w - tile * level_scale, 1), count)
+    step = tile * level_scale
+
+    def read(yx):
+        y, x = yx
+        return image[y:y + step:level_scale, x:x + step:level_scale].nbytes
+
+    with ThreadPoolExecutor(workers) as pool:
+        start = time.perf_counter()
+        total = sum(pool.map(read, zip(ys, xs)))
+        elapsed = time.perf_counter() - start
+    return count / elapsed, total / elapsed / 2 ** 20
+
+
+# usage: python bench.py slide.svs
+filename, = sys.argv[1:]
+image = ts.Image(filename)
+ts.set_cache_size(0)  # measure decode, not cache hits
+print(f'{filename}: shape: {image.shape}, scales: {image.scales}')
+
+for scale in image.scales:
+    for workers in (1, 2, 4, 8, os.cpu_count()):
+        tps, mbps = bench(image, scale, workers)
+        print(f'  scale 1:{scale:<3} threads {workers:>2}: '
+              f'{tps:8.1f} reads/s, {mbps:8.1f} MiB/s')
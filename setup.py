@@ -11,6 +11,7 @@ from setuptools.command.build_ext import build_ext
 
 PACKAGE = 'torchslide'
 LIBRARIES = [
+    'jpeg',
     'openjp2',
     'tiff',
     ('lib' if os.name == 'nt' else '') + 'openslide',
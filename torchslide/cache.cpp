@@ -0,0 +1,11 @@
+#include "cache.h"
+
+namespace ts {
+
+TileCache& tile_cache() noexcept {
+    /// 32 MiB by default, like OpenSlide's own tile cache
+    static TileCache cache{size_t{32} << 20};
+    return cache;
+}
+
+} // namespace ts
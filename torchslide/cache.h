@@ -1,75 +1,111 @@
 ﻿#pragma once
 
-#include <functional>
 #include <future>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
-#include <optional>
 #include <tuple>
-#include <type_traits>
 
-namespace traits {
+#include "core/std.h"
+#include "tensor.h"
 
-template <typename Ret, typename Cls, typename... Args>
-struct _lambda_types {
-    using result = Ret;
-    using args = std::tuple<Args...>;
-};
+namespace ts {
 
-template <typename Ld>
-struct lambda : lambda<decltype(&Ld::operator())> {};
+struct CacheInfo {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t size;
+    size_t capacity;
+};
 
-template <typename Ret, typename Cls, typename... Args>
-struct lambda<Ret(Cls::*)(Args...)> : _lambda_types<Ret, Cls, Args...> {};
+/// Fallback footprint for values which don't report their own via `nbytes`
+template <typename T>
+size_t nbytes(T const&) noexcept { return sizeof(T); }
 
-template <typename Ret, typename Cls, typename... Args>
-struct lambda<Ret(Cls::*)(Args...) const> : _lambda_types<Ret, Cls, Args...> {};
+/// Thread-safe LRU cache with byte budget.
+/// Concurrent misses on the same key are single-flight: one caller runs
+/// the loader, others wait for its result.
+/// Loads run inside `NoFork`, so child of fork never inherits pending ones.
+template <typename Key, typename Ret>
+struct Cache {
+    using Value = std::shared_ptr<Ret const>;
 
-} // namespace traits
+    Cache(size_t capacity = 0) noexcept : capacity_{capacity} {}
 
-namespace ts {
+    template <typename Fn>
+    Value operator()(Key const& key, Fn&& fn) {
+        std::unique_lock lk{this->mutex_};
+        if (auto opt = this->get(key)) {
+            ++this->hits_;
+            return opt;
+        }
+        if (auto run = this->futures_.find(key); run != this->futures_.end()) {
+            ++this->hits_;
+            auto pending = run->second;
+            lk.unlock();
+            return pending.get();
+        }
+        ++this->misses_;
+        std::promise<Value> promise;
+        this->futures_.emplace(key, promise.get_future().share());
+        lk.unlock();
+
+        Value value;
+        try {
+            value = std::make_shared<Ret const>(fn());
+        } catch (...) {
+            lk.lock();
+            this->futures_.erase(key);
+            lk.unlock();
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+        lk.lock();
+        this->put(key, value);
+        this->futures_.erase(key);
+        lk.unlock();
+        promise.set_value(value);
+        return value;
+    }
 
-template <typename Fn>
-struct Cache {
-    Cache() = default;
-    Cache(Fn&& fn, size_t capacity)
-      : fn_{fn}
-      , capacity_{capacity}
-    {}
-
-    template <typename... Args>
-    Value operator()(Args... args) {
-        return this->get_future({args...}).get();
+    void resize(size_t capacity) {
+        std::unique_lock lk{this->mutex_};
+        this->capacity_ = capacity;
+        this->shrink_to(capacity);
     }
 
-private:
-    using Ret = typename traits::lambda<Fn>::result;
-    using Key = typename traits::lambda<Fn>::args;
-    using Value = std::shared_ptr<Ret>;
+    void clear() {
+        std::unique_lock lk{this->mutex_};
+        this->shrink_to(0);
+    }
 
-    using Future = std::shared_future<Value>;
+    CacheInfo info() const {
+        std::unique_lock lk{this->mutex_};
+        return {
+            this->hits_,
+            this->misses_,
+            this->evictions_,
+            this->size_,
+            this->capacity_};
+    }
 
-    Fn fn_ = {};
-    std::mutex mutex_ = {};
+private:
+    std::mutex mutable mutex_ = {};
 
     size_t size_ = 0;
     size_t capacity_ = 0;
 
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    size_t evictions_ = 0;
+
     std::list<Key> lru_;
     std::map<Key, std::pair<Value, typename std::list<Key>::iterator>> map_;
-    std::map<Key, Future> futures_;
-
-    size_t size_hint(Value const& value) noexcept {
-        if constexpr (!std::is_class_v<Ret>)
-            return sizeof(Value);
-        else if constexpr(!std::is_member_function_pointer_v<decltype(&Ret::size)>)
-            return sizeof(Value);
-        else
-            return value->size();
-    }
+    std::map<Key, std::shared_future<Value>> futures_;
 
-    std::optional<Value> get(Key const& key) {
+    Value get(Key const& key) {
         auto search = this->map_.find(key);
         if (search == this->map_.end())
             return {};
@@ -79,43 +115,32 @@ private:
         return value;
     }
 
-    void put(Key const& key, Value const& value) {
-        auto size = this->size_hint(value);
-
-        if (size > this->capacity_)
-            return;
-        while (this->size_ + size > this->capacity_) {
+    void shrink_to(size_t capacity) {
+        while (this->size_ > capacity) {
             auto nh = this->map_.extract(this->lru_.front());
-            this->size_ -= this->size_hint(nh.mapped().first);
+            this->size_ -= nbytes(*nh.mapped().first);
             this->lru_.pop_front();
+            ++this->evictions_;
         }
+    }
 
+    void put(Key const& key, Value const& value) {
+        auto size = nbytes(*value);
+        if (size > this->capacity_)
+            return;
+
+        this->shrink_to(this->capacity_ - size);
         auto pos = this->lru_.insert(this->lru_.end(), key);
         this->map_[key] = std::make_pair(value, pos);
         this->size_ += size;
     }
-
-    Future get_future(Key const& key) {
-        std::unique_lock lk{this->mutex_};
-        auto opt = this->get(key);
-        if (opt)
-            return std::async(std::launch::deferred, [opt](){ return *opt; });
-
-        if (auto run = this->futures_.find(key); run != this->futures_.end())
-            return run->second;
-
-        Future pending = std::async(std::launch::deferred, [&key, this](){
-            auto value = std::make_shared<Ret>(std::apply(this->fn_, key));
-            {
-                std::unique_lock lk_{this->mutex_};
-                this->put(key, value);
-                this->futures_.erase(key);
-            }
-            return value;
-        });
-        this->futures_[key] = pending;
-        return pending;
-    }
 };
 
+/// Tile address: image uid, level, its reduction and top-left corner of tile
+using TileKey = std::tuple<size_t, Level, uint8_t, uint32_t, uint32_t>;
+using TileCache = Cache<TileKey, AnyTensor>;
+
+/// Process-wide cache of decoded tiles, shared by all opened images
+TileCache& tile_cache() noexcept;
+
 } // namespace ts
@@ -1,6 +1,15 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <string_view>
+#include <thread>
+
 #include <openjpeg-2.3/openjpeg.h>
 
 #include "codec_j2k.h"
+#include "core/simd.h"
 #include "core/traits.h"
 
 namespace ts::j2k {
@@ -46,8 +55,10 @@ void opj_mem_nop(void*) {}
 
 // TODO: fuck this, rewrite in Rust
 
-std::optional<OPJ_CODEC_FORMAT> _check_signature(Bitstream const& src) noexcept {
-    std::string_view const sig = {src.data(), 12};
+std::optional<OPJ_CODEC_FORMAT> _check_signature(std::span<uint8_t const> src) noexcept {
+    if (src.size() < 12)
+        return {};
+    std::string_view const sig = {reinterpret_cast<char const*>(src.data()), 12};
     if (sig.substr(0, 4) == "\xff\x4f\xff\x51")
         return OPJ_CODEC_J2K;
 
@@ -71,13 +82,76 @@ opj_stream_t* _make_obj_stream(opj_memstream_t* memstream) {
     return stream;
 }
 
-Result<_RType> decode(Bitstream const& src) {
+/// Count of decodes running now, spare cores are split between them
+std::atomic<unsigned> _active = 0;
+
+struct _Active {
+    _Active() noexcept { ++_active; }
+    ~_Active() noexcept { --_active; }
+};
+
+template <typename T>
+T _clip(float value, float max) noexcept {
+    return static_cast<T>(std::clamp(value + 0.5f, 0.f, max));
+}
+
+/// Interleaves 3 planes to `dst` row by row, converting YCbCr to RGB
+/// on the way. Loop body has no branches and no aliasing, so it's
+/// vectorized by compiler (i.e. to shuffles + stores on AVX2,
+/// to vst3 on NEON).
+template <typename T, bool YCbCr>
+_TS_SIMD_CLONES void _pack3(opj_image_t const& image, T* __restrict dst, size_t stride) noexcept {
+    auto const& comp = image.comps[0];
+    auto const half = static_cast<float>(1u << (comp.prec - 1));
+    auto const max = static_cast<float>((1ull << comp.prec) - 1);
+
+    for (OPJ_UINT32 y = 0; y < comp.h; ++y, dst += stride) {
+        auto offset = size_t{y} * comp.w;
+        OPJ_INT32 const* __restrict p0 = image.comps[0].data + offset;
+        OPJ_INT32 const* __restrict p1 = image.comps[1].data + offset;
+        OPJ_INT32 const* __restrict p2 = image.comps[2].data + offset;
+        for (size_t x = 0; x < comp.w; ++x) {
+            if constexpr (YCbCr) {
+                auto luma = static_cast<float>(p0[x]);
+                auto cb = static_cast<float>(p1[x]) - half;
+                auto cr = static_cast<float>(p2[x]) - half;
+                dst[3 * x] = _clip<T>(luma + 1.402f * cr, max);
+                dst[3 * x + 1] = _clip<T>(luma - 0.344136f * cb - 0.714136f * cr, max);
+                dst[3 * x + 2] = _clip<T>(luma + 1.772f * cb, max);
+            } else {
+                dst[3 * x] = static_cast<T>(p0[x]);
+                dst[3 * x + 1] = static_cast<T>(p1[x]);
+                dst[3 * x + 2] = static_cast<T>(p2[x]);
+            }
+        }
+    }
+}
+
+/// Interleaves any count of planes, one strided pass per plane
+template <typename T>
+_TS_SIMD_CLONES void _pack(opj_image_t const& image, T* __restrict dst, size_t stride) noexcept {
+    auto const samples = image.numcomps;
+    auto const& comp = image.comps[0];
+    for (OPJ_UINT32 y = 0; y < comp.h; ++y, dst += stride)
+        for (OPJ_UINT32 i = 0; i < samples; ++i) {
+            OPJ_INT32 const* __restrict p = image.comps[i].data + size_t{y} * comp.w;
+            for (size_t x = 0; x < comp.w; ++x)
+                dst[x * samples + i] = static_cast<T>(p[x]);
+        }
+}
+
+template <typename T>
+Result<Shape> decode(
+    std::span<uint8_t const> src,
+    Color color,
+    Tensor<T>& out,
+    uint8_t reduce,
+    std::optional<Box> region) {
     auto codecformat = _check_signature(src);
     if (!codecformat)
         return Error{"not a J2K or JP2 data stream"};
 
-    opj_memstream_t memstream = {
-        reinterpret_cast<OPJ_UINT8 const*>(src.data()), src.size(), 0, 0};
+    opj_memstream_t memstream = {src.data(), src.size(), 0, 0};
     auto* stream = _make_obj_stream(&memstream);
     if (!stream)
         return Error{"opj_memstream_create failed"};
@@ -88,8 +162,16 @@ Result<_RType> decode(Bitstream const& src) {
         return Error{"opj_create_decompress failed"};
     auto _codec = make_owner(codec, opj_destroy_codec);
 
+    /// Tiles are usually decoded in parallel already, so OpenJPEG's own
+    /// threads only take cores left idle by other decodes
+    _Active active;
+    auto threads = std::max(std::thread::hardware_concurrency() / _active.load(), 1u);
+    if (threads > 1 && opj_has_thread_support())
+        opj_codec_set_threads(codec, static_cast<int>(threads));
+
     opj_dparameters_t parameters;
     opj_set_default_decoder_parameters(&parameters);
+    parameters.cp_reduce = reduce;
 
     if (!opj_setup_decoder(codec, &parameters))
         return Error{"opj_setup_decoder failed"};
@@ -99,10 +181,21 @@ Result<_RType> decode(Bitstream const& src) {
         return Error{"opj_read_header failed"};
     auto _image = make_owner(image, opj_image_destroy);
 
-    if (!opj_set_decode_area(
-            codec, image,
-            parameters.DA_x0, parameters.DA_y0, parameters.DA_x1, parameters.DA_y1))
-        return Error{"opj_set_decode_area failed"};
+    /// Area is set on full resolution grid, even when reduced
+    if (region) {
+        auto clip = [](Size v, OPJ_UINT32 lo, OPJ_UINT32 hi) {
+            return static_cast<OPJ_INT32>(std::clamp<Size>(v, lo, hi));
+        };
+        auto [y0, x0] = region->min_;
+        auto [y1, x1] = region->max_;
+        if (!opj_set_decode_area(
+                codec, image,
+                clip(image->x0 + (x0 << reduce), image->x0, image->x1),
+                clip(image->y0 + (y0 << reduce), image->y0, image->y1),
+                clip(image->x0 + (x1 << reduce), image->x0, image->x1),
+                clip(image->y0 + (y1 << reduce), image->y0, image->y1)))
+            return Error{"opj_set_decode_area failed"};
+    }
 
     if (!opj_decode(codec, stream, image))
         return Error{"opj_decode failed"};
@@ -110,20 +203,35 @@ Result<_RType> decode(Bitstream const& src) {
         return Error{"opj_end_decompress failed"};
 
     // handle subsampling and color profiles
-    if (image->color_space != OPJ_CLRSPC_SRGB)
+    bool ycbcr = false;
+    switch (image->color_space) {
+    case OPJ_CLRSPC_UNKNOWN:
+    case OPJ_CLRSPC_UNSPECIFIED:
+        ycbcr = (color == Color::YCbCr);
+        break;
+    case OPJ_CLRSPC_SYCC:
+        ycbcr = true;
+        break;
+    case OPJ_CLRSPC_SRGB:
+    case OPJ_CLRSPC_GRAY:
+        break;
+    default:
         return Error{"unusupported colorspace"};
+    }
 
     opj_image_comp_t* comp = &image->comps[0];
     if (comp->sgnd)
         return Error{"signed is not supported"};
 
     auto prec = comp->prec;
-    auto height = comp->h * comp->dy;
-    auto width = comp->w * comp->dx;
+    auto height = comp->h;
+    auto width = comp->w;
     auto samples = image->numcomps;
     auto itemsize = (prec + 7) / 8;
+    if (ycbcr && samples != 3)
+        return Error{"YCbCr must have 3 components"};
 
-    for (ssize_t i = 0; i < samples; ++i) {
+    for (OPJ_UINT32 i = 0; i < samples; ++i) {
         comp = &image->comps[i];
         if (comp->sgnd || comp->prec != prec)
             return Error{"components dtype mismatch"};
@@ -132,29 +240,47 @@ Result<_RType> decode(Bitstream const& src) {
     }
     if (itemsize == 3)
         itemsize = 4;
-    else if (itemsize < 1 || itemsize > 4)
-        return Error{"unsupported itemsize"};
-
-    auto dtype = make_variant_if([itemsize](auto v){
-        return std::is_unsigned_v<decltype(v)> && (sizeof(v) == itemsize);
-    }, DType{});
-    if (!dtype)
-        return Error{"Can't get dtype"};
-
-        Bitstream dst(height * width * samples * itemsize);
-    std::visit(
-        [&, samples, total = height * width](auto v){
-            using Type = std::decay_t<decltype(v)>;
-            for (ssize_t i = 0; i < samples; ++i) {
-                auto* ix = reinterpret_cast<Type*>(dst.data()) + i;
-                auto* band = image->comps[i].data;
-                for (ssize_t j = 0; j < total; ++j)
-                    ix[j * samples] = static_cast<Type>(band[j]);
-            }
-        },
-        dtype.value()
-    );
-    return _RType{dst, {height, width, samples}, dtype.value()};
+    if (!std::is_unsigned_v<T> || sizeof(T) != itemsize)
+        return Error{"dtype mismatch"};
+
+    auto const& shape = *out.shape();
+    if (shape[2] != samples || shape[0] < height || shape[1] < width)
+        return Error{"tile shape mismatch"};
+
+    auto const stride = static_cast<size_t>(shape[1]) * samples;
+    if (samples != 3)
+        _pack(*image, out.data(), stride);
+    else if (ycbcr)
+        _pack3<T, true>(*image, out.data(), stride);
+    else
+        _pack3<T, false>(*image, out.data(), stride);
+    return Shape{height, width, samples};
+}
+
+#define _TS_DECODE(T) \
+    template Result<Shape> decode( \
+        std::span<uint8_t const>, Color, Tensor<T>&, uint8_t, std::optional<Box>);
+_TS_DECODE(uint8_t)
+_TS_DECODE(uint16_t)
+_TS_DECODE(uint32_t)
+_TS_DECODE(float)
+#undef _TS_DECODE
+
+size_t decompositions(std::span<uint8_t const> src) noexcept {
+    if (src.size() < 2 || src[0] != 0xff || src[1] != 0x4f)
+        return 0;
+
+    /// Walk marker segments of main header until first tile-part (SOT).
+    /// COD is: marker, Lcod (2), Scod (1), SGcod (4), then levels count
+    for (size_t pos = 2; pos + 4 <= src.size() && src[pos] == 0xff;) {
+        auto marker = src[pos + 1];
+        if (marker == 0x90)
+            break;
+        if (marker == 0x52)
+            return (pos + 9 < src.size()) ? src[pos + 9] : 0;
+        pos += 2 + (size_t{src[pos + 2]} << 8 | src[pos + 3]);
+    }
+    return 0;
 }
 
 } // namespace ts::j2k
@@ -1,35 +1,43 @@
 #pragma once
 
 #include <cstddef>
-#include <vector>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <variant>
 
+#include "core/box.h"
 #include "tensor.h"
 
 namespace ts::j2k {
 
-using Bitstream = std::vector<char>;
 using Error = std::string;
 
 template <class T>
 using Result = std::variant<T, Error>;
 
-struct _RType {
-    Bitstream data;
-    Shape shape;
-    DType dtype;
-};
-
-Result <_RType> decode(Bitstream const&);
-
+/// Color of components in codestream, when it isn't told by JP2 header.
+/// For TIFF it's known from compression: 33003 is YCbCr, 33005 is RGB.
+enum class Color { RGB, YCbCr };
+
+/// Decodes J2K codestream or JP2 file straight to `out` of (H, W, samples)
+/// shape, YCbCr is converted to RGB. Image may be smaller than `out`,
+/// then the rest of `out` is left untouched.
+/// With `reduce` image is decoded at 1/2^reduce resolution, skipping
+/// finest wavelet levels. With `region` (in coordinates of reduced image)
+/// only code-blocks covering it are decoded.
+/// Returns shape of decoded image.
 template <typename T>
-Tensor<T> unwrap(_RType const& storage) {
-    Tensor<T> out{storage.shape};
-    std::copy_n(
-        storage.data.data(),
-        static_cast<Bitstream::value_type*>(out.data()),
-        storage.data.size(),
-    );
-    return out;
-}
+Result<Shape> decode(
+    std::span<uint8_t const> src,
+    Color color,
+    Tensor<T>& out,
+    uint8_t reduce = 0,
+    std::optional<Box> region = {});
+
+/// Count of wavelet decompositions from main header of J2K codestream,
+/// i.e. how many times it can be reduced. 0 if unknown.
+size_t decompositions(std::span<uint8_t const> src) noexcept;
 
 } // namespace ts::j2k
@@ -0,0 +1,100 @@
+#include <csetjmp>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+#include <jpeglib.h>
+
+#include "codec_jpeg.h"
+
+namespace ts::jpeg {
+
+struct _Error {
+    jpeg_error_mgr pub;
+    std::jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+void _on_error(j_common_ptr cinfo) {
+    auto* err = reinterpret_cast<_Error*>(cinfo->err);
+    (*cinfo->err->format_message)(cinfo, err->message);
+    std::longjmp(err->jump, 1);
+}
+
+void _on_message(j_common_ptr) {}
+
+void _set_source(j_decompress_ptr cinfo, std::span<uint8_t const> data) {
+    jpeg_mem_src(
+        cinfo,
+        const_cast<unsigned char*>(data.data()),
+        static_cast<unsigned long>(data.size()));
+}
+
+/// Only trivially destructible objects live between setjmp and longjmp,
+/// so it's safe to jump over them
+void decode(
+    std::span<uint8_t const> data,
+    std::span<uint8_t const> tables,
+    Color color,
+    Tensor<uint8_t>& out,
+    unsigned denom) {
+    auto const& shape = out.shape();
+    auto const height = static_cast<JDIMENSION>((*shape)[0]);
+    auto const width = static_cast<JDIMENSION>((*shape)[1]);
+    auto const samples = static_cast<int>((*shape)[2]);
+    char const* mismatch = nullptr;
+
+    jpeg_decompress_struct cinfo;
+    _Error err;
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = _on_error;
+    err.pub.output_message = _on_message;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        throw std::runtime_error{std::string{"JPEG: "} + err.message};
+    }
+    jpeg_create_decompress(&cinfo);
+
+    if (!tables.empty()) {
+        _set_source(&cinfo, tables);
+        jpeg_read_header(&cinfo, FALSE);
+    }
+    _set_source(&cinfo, data);
+    jpeg_read_header(&cinfo, TRUE);
+
+    /// TIFF's JPEG streams have no JFIF/Adobe markers,
+    /// so color space is known only from PhotometricInterpretation
+    switch (color) {
+    case Color::Gray:
+        cinfo.out_color_space = JCS_GRAYSCALE;
+        break;
+    case Color::RGB:
+        cinfo.jpeg_color_space = JCS_RGB;
+        cinfo.out_color_space = JCS_RGB;
+        break;
+    case Color::YCbCr:
+        cinfo.jpeg_color_space = JCS_YCbCr;
+        cinfo.out_color_space = JCS_RGB;
+        break;
+    }
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+    jpeg_start_decompress(&cinfo);
+
+    if (cinfo.output_components != samples)
+        mismatch = "JPEG: sample count mismatch";
+    else if (cinfo.output_width != width || cinfo.output_height < height)
+        mismatch = "JPEG: tile shape mismatch";
+    else {
+        auto stride = static_cast<size_t>(width) * samples;
+        while (cinfo.output_scanline < height) {
+            JSAMPROW row = out.data() + cinfo.output_scanline * stride;
+            jpeg_read_scanlines(&cinfo, &row, 1);
+        }
+    }
+    jpeg_destroy_decompress(&cinfo);
+    if (mismatch)
+        throw std::runtime_error{mismatch};
+}
+
+} // namespace ts::jpeg
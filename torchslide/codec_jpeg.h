@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+#include "tensor.h"
+
+namespace ts::jpeg {
+
+enum class Color { Gray, RGB, YCbCr };
+
+/// Decodes JPEG stream directly to `out` of (H, W, samples) shape.
+/// Stream may be abbreviated (i.e. TIFF tile), then quantization and
+/// Huffman tables are taken from `tables` (i.e. TIFF JPEGTables tag).
+/// With `denom` of 2, 4 or 8 image is downscaled by IDCT itself,
+/// which is much cheaper than full decode.
+/// Throws `std::runtime_error` on broken stream or shape mismatch.
+void decode(
+    std::span<uint8_t const> data,
+    std::span<uint8_t const> tables,
+    Color color,
+    Tensor<uint8_t>& out,
+    unsigned denom = 1);
+
+} // namespace ts::jpeg
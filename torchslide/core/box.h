@@ -8,6 +8,8 @@ struct Box {
     Size min_[2];
     Size max_[2];
     Level level = 1;
+    /// Number of times level is halved by codec while decoding
+    uint8_t reduce = 0;
 
     constexpr Size shape(size_t dim) const noexcept {
         return static_cast<Size>(std::max(max_[dim] - min_[dim], Size{}));
@@ -24,8 +26,19 @@ struct Box {
                 std::clamp(max_[1], Size{}, shape[1])
             },
             level,
+            reduce,
         };
     };
 };
 
+/// Footprints of output pixels inside of source box. Along each axis
+/// pixel `i` covers [start + i * step, start + (i + 1) * step), measured
+/// in 1/unit of source pixel, so filter weights are exact.
+struct Area {
+    Size start[2];
+    Size step[2];
+    Size unit;
+    Size shape[2];
+};
+
 } // namespace ts
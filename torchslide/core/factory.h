@@ -1,8 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
 #include <map>
 #include <memory>
+#include <span>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
@@ -13,16 +15,22 @@ using Path = std::filesystem::path;
 
 template <class Base>
 struct Factory {
-    static std::unique_ptr<Base> make(std::string const& filename) {
+    /// Opens `filename`. If `state` saved by the same reader is given and
+    /// still matches the file, reader restores from it without parsing.
+    static std::unique_ptr<Base>
+    make(std::string const& filename, std::span<uint8_t const> state = {}) {
         Path path{filename};
         auto it = data().find(path.extension().string());
         if (it == data().end())
             throw std::runtime_error{"Unsupported extension"};
 
         std::exception_ptr eptr;
-        for (auto&& [prio, factory]: it->second)
+        for (auto&& [prio, entry]: it->second)
             try {
-                return factory(path);
+                if (!state.empty() && entry.restore)
+                    if (auto ptr = entry.restore(path, state))
+                        return ptr;
+                return entry.make(path);
             } catch (...) {
                 eptr = std::current_exception();
             }
@@ -43,8 +51,11 @@ struct Factory {
             static_assert(
                 std::is_base_of_v<Register<Derived>, Derived>,
                 "Class is not inherited from Base::Register!");
+            _Entry entry{&Derived::make_this, nullptr};
+            if constexpr (requires { &Derived::restore_this; })
+                entry.restore = &Derived::restore_this;
             for (auto const& ext : Derived::extensions)
-                Factory::data()[ext][Derived::priority] = &Derived::make_this;
+                Factory::data()[ext][Derived::priority] = entry;
             return true;
         }
 
@@ -55,10 +66,15 @@ private:
     friend Base;
     Factory() = default;
 
+    struct _Entry {
+        std::unique_ptr<Base> (*make)(Path const&);
+        /// Optional, returns nullptr if state is not of this reader
+        std::unique_ptr<Base> (*restore)(
+            Path const&, std::span<uint8_t const>);
+    };
+
     static auto& data() noexcept {
-        static std::unordered_map<
-            std::string,
-            std::map<int, std::unique_ptr<Base> (*)(Path const&)>>
+        static std::unordered_map<std::string, std::map<int, _Entry>>
             factories;
         return factories;
     }
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+namespace ts {
+
+/// Handlers of `at_fork`. Parent's and child's run in reverse order.
+struct ForkHook {
+    void (*prepare)();
+    void (*parent)();
+    void (*child)();
+};
+
+namespace _detail {
+
+/// Fork waits until no thread is inside `NoFork`, and holds off new ones
+/// until it's done. So locks and once-flags taken only inside of it are
+/// never inherited by child in locked state.
+struct _Fork {
+    std::atomic<size_t> count = 0;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t busy = 0;
+    bool forking = false;
+
+    std::vector<ForkHook> hooks;
+
+    void enter() {
+        std::unique_lock lk{this->mutex};
+        this->cv.wait(lk, [this] { return !this->forking; });
+        ++this->busy;
+    }
+
+    void leave() {
+        std::unique_lock lk{this->mutex};
+        if (!--this->busy)
+            this->cv.notify_all();
+    }
+
+    /// Keeps `mutex` locked until fork is done
+    void prepare() {
+        std::unique_lock lk{this->mutex};
+        this->forking = true;
+        this->cv.wait(lk, [this] { return !this->busy; });
+        lk.release();
+        for (auto const& hook : this->hooks)
+            hook.prepare();
+    }
+
+    void parent() {
+        for (auto it = this->hooks.rbegin(); it != this->hooks.rend(); ++it)
+            it->parent();
+        this->forking = false;
+        this->mutex.unlock();
+        this->cv.notify_all();
+    }
+
+    void child() {
+        ++this->count;
+        for (auto it = this->hooks.rbegin(); it != this->hooks.rend(); ++it)
+            it->child();
+        this->forking = false;
+        this->mutex.unlock();
+        /// Threads waiting in parent don't exist here
+        new (&this->cv) std::condition_variable;
+    }
+};
+
+/// Never destroyed, as fork may happen while static objects are
+inline _Fork& _fork() noexcept {
+    static auto* const state = [] {
+        auto ptr = new _Fork;
+#ifndef _WIN32
+        pthread_atfork(
+            [] { _fork().prepare(); },
+            [] { _fork().parent(); },
+            [] { _fork().child(); });
+#endif
+        return ptr;
+    }();
+    return *state;
+}
+
+} // namespace _detail
+
+/// Count of forks which led to this process. Threads and file handles
+/// (sharing offsets with parent) are not valid in child, so their
+/// owners recreate them once the count changes.
+inline size_t fork_epoch() noexcept {
+    return _detail::_fork().count.load(std::memory_order_relaxed);
+}
+
+/// Scope of work during which process must not fork, i.e. decoding which
+/// holds locks of caches and handle pools. Must not wait for GIL inside,
+/// as forking thread holds it. Nested scopes of one thread are free.
+struct NoFork {
+    NoFork() {
+        if (!_depth++)
+            _detail::_fork().enter();
+    }
+    ~NoFork() {
+        if (!--_depth)
+            _detail::_fork().leave();
+    }
+    NoFork(NoFork const&) = delete;
+    NoFork& operator=(NoFork const&) = delete;
+
+private:
+    static inline thread_local size_t _depth = 0;
+};
+
+/// Registers handlers for locks taken outside of `NoFork`.
+/// `prepare` runs once no thread is inside of it.
+inline void at_fork(ForkHook hook) {
+    auto& state = _detail::_fork();
+    std::unique_lock lk{state.mutex};
+    state.hooks.push_back(hook);
+}
+
+} // namespace ts
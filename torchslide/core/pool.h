@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fork.h"
+
+namespace ts {
+
+/// Bounded pool of lazily created resources (i.e. file handles).
+/// Each `Lease` gives exclusive access to one resource until destroyed,
+/// `acquire` blocks when all `capacity` resources are leased out.
+/// After fork child drops inherited resources and creates its own.
+template <typename T>
+struct Pool {
+    struct Lease {
+        Lease(Pool const* pool, std::unique_ptr<T> ptr) noexcept
+          : _pool{pool}
+          , _ptr{std::move(ptr)}
+          , _epoch{pool->_epoch} { }
+        Lease(Lease&&) noexcept = default;
+        ~Lease() noexcept {
+            if (_ptr)
+                _pool->release(std::move(_ptr), _epoch);
+        }
+
+        T& operator*() const noexcept { return *_ptr; }
+        T* operator->() const noexcept { return _ptr.get(); }
+
+        /// Destroys broken resource instead of returning it,
+        /// so pool creates new one in its place
+        void discard() noexcept {
+            if (!_ptr)
+                return;
+            _ptr.reset();
+            _pool->forget(_epoch);
+        }
+
+    private:
+        Pool const* _pool;
+        std::unique_ptr<T> _ptr;
+        size_t _epoch;
+    };
+
+    Pool(std::function<T()> factory, size_t capacity = default_capacity())
+      : _factory{std::move(factory)}
+      , _capacity{std::max(capacity, size_t{1})} {
+        _idle.reserve(_capacity);
+    }
+
+    /// Adopts already created resource, i.e. one used to read metadata
+    Pool(T value, std::function<T()> factory,
+         size_t capacity = default_capacity())
+      : Pool{std::move(factory), capacity} {
+        _idle.push_back(std::make_unique<T>(std::move(value)));
+        _count = 1;
+    }
+
+    Lease acquire() const {
+        std::unique_lock lk{_mutex};
+        if (auto epoch = fork_epoch(); _epoch != epoch) {
+            /// Leases of parent's threads are never returned here
+            _idle.clear();
+            _count = 0;
+            _epoch = epoch;
+        }
+        _cv.wait(lk, [this] { return !_idle.empty() || _count < _capacity; });
+        if (!_idle.empty()) {
+            auto ptr = std::move(_idle.back());
+            _idle.pop_back();
+            return {this, std::move(ptr)};
+        }
+        ++_count;
+        lk.unlock();
+        try {
+            return {this, std::make_unique<T>(_factory())};
+        } catch (...) {
+            lk.lock();
+            --_count;
+            _cv.notify_one();
+            throw;
+        }
+    }
+
+    static size_t default_capacity() noexcept {
+        return std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+private:
+    std::function<T()> _factory;
+    size_t const _capacity;
+
+    std::mutex mutable _mutex;
+    std::condition_variable mutable _cv;
+    std::vector<std::unique_ptr<T>> mutable _idle;
+    size_t mutable _count = 0;
+    size_t mutable _epoch = fork_epoch();
+
+    void release(std::unique_ptr<T> ptr, size_t epoch) const noexcept {
+        {
+            std::unique_lock lk{_mutex};
+            if (epoch != _epoch)
+                return;
+            _idle.push_back(std::move(ptr));
+        }
+        _cv.notify_one();
+    }
+
+    void forget(size_t epoch) const noexcept {
+        {
+            std::unique_lock lk{_mutex};
+            if (epoch != _epoch)
+                return;
+            --_count;
+        }
+        _cv.notify_one();
+    }
+};
+
+} // namespace ts
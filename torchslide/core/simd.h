@@ -0,0 +1,10 @@
+#pragma once
+
+/// Kernels marked with it are built for baseline ISA and for AVX2 on x86,
+/// copy is picked once at load time. Elsewhere (i.e. NEON) baseline is
+/// enough for compiler to vectorize them.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define _TS_SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define _TS_SIMD_CLONES
+#endif
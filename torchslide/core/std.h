@@ -23,13 +23,16 @@ using DType = std::variant<uint8_t, uint16_t, uint32_t, float>;
 
 // ------------------------------- some math -------------------------------
 
+/// Multiple of positive `factor` not above `num`, negative `num` too
 template <typename T>
-constexpr T floor(T num, T factor) noexcept { return num - num % factor; }
+constexpr T floor(T num, T factor) noexcept {
+    auto rem = num % factor;
+    return num - (rem < 0 ? rem + factor : rem);
+}
 
 template <typename T>
 constexpr T ceil(T num, T factor) noexcept {
-    num += factor - 1;
-    return num - num % factor;
+    return floor(num + factor - 1, factor);
 }
 
 // ------------------------- container conversions -------------------------
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "fork.h"
+
+namespace ts {
+
+namespace _detail {
+struct _Pools;
+} // namespace _detail
+
+/// Fixed-size pool of worker threads
+struct ThreadPool {
+    ThreadPool(size_t workers = std::thread::hardware_concurrency()) {
+        workers = std::max(workers, size_t{1});
+        for (size_t i = 0; i < workers; ++i)
+            _threads.emplace_back([this] { this->_loop(); });
+    }
+
+    ~ThreadPool() noexcept {
+        if (this->epoch != fork_epoch()) {
+            this->_forget();
+            return;
+        }
+        {
+            std::unique_lock lk{_mutex};
+            _stop = true;
+        }
+        _cv.notify_all();
+        for (auto& t : _threads)
+            t.join();
+    }
+
+    size_t size() const noexcept { return _threads.size(); }
+
+    /// Threads of pool exist only in process which created it
+    size_t const epoch = fork_epoch();
+
+    template <typename Fn>
+    auto submit(Fn&& fn) -> std::future<std::invoke_result_t<Fn>> {
+        using Ret = std::invoke_result_t<Fn>;
+        auto task = std::make_shared<std::packaged_task<Ret()>>(
+            std::forward<Fn>(fn));
+        auto future = task->get_future();
+        this->_push([task] { (*task)(); });
+        return future;
+    }
+
+    /// Calls `fn(i)` for each `i` in [0, count), blocks until all are done.
+    /// Calling thread takes its share of work too, so nested calls from
+    /// workers can't deadlock even if all other workers are busy.
+    template <typename Fn>
+    void parallel_for(size_t count, Fn&& fn) {
+        if (count == 0)
+            return;
+        if (count == 1)
+            return (void)fn(size_t{0});
+
+        struct State {
+            std::atomic<size_t> next = 0;
+            size_t done = 0;
+            std::exception_ptr eptr;
+            std::mutex mutex;
+            std::condition_variable cv;
+        };
+        auto state = std::make_shared<State>();
+        auto work = [state, count, &fn] {
+            for (size_t i; (i = state->next++) < count;) {
+                std::exception_ptr eptr;
+                try {
+                    fn(i);
+                } catch (...) {
+                    eptr = std::current_exception();
+                }
+                std::unique_lock lk{state->mutex};
+                if (eptr && !state->eptr)
+                    state->eptr = eptr;
+                if (++state->done == count)
+                    state->cv.notify_all();
+            }
+        };
+        auto helpers = std::min(count, this->size() + 1) - 1;
+        for (size_t i = 0; i < helpers; ++i)
+            this->_push(work);
+        work();
+
+        std::unique_lock lk{state->mutex};
+        state->cv.wait(lk, [&] { return state->done == count; });
+        if (state->eptr)
+            std::rethrow_exception(state->eptr);
+    }
+
+private:
+    std::vector<std::thread> _threads;
+    std::deque<std::function<void()>> _tasks;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _stop = false;
+
+    friend struct _detail::_Pools;
+
+    /// After fork workers don't exist, so neither they can be joined, nor
+    /// `_cv` destroyed while they are its waiters. Their handles and
+    /// waiters are dropped without a word to threading library.
+    void _forget() noexcept {
+        for (auto& t : _threads)
+            new (&t) std::thread;
+        new (&_cv) std::condition_variable;
+    }
+
+    void _push(std::function<void()> task) {
+        {
+            std::unique_lock lk{_mutex};
+            _tasks.push_back(std::move(task));
+        }
+        _cv.notify_one();
+    }
+
+    void _loop() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock lk{_mutex};
+                _cv.wait(lk, [this] { return _stop || !_tasks.empty(); });
+                if (_stop && _tasks.empty())
+                    return;
+                task = std::move(_tasks.front());
+                _tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+namespace _detail {
+
+/// State of `thread_pool()`. Its locks are held over fork, so child can
+/// discard pool of parent and create its own on demand.
+struct _Pools {
+    std::atomic<ThreadPool*> pool = nullptr;
+    std::mutex mutex;
+
+    static _Pools& get() noexcept {
+        static auto* const state = [] {
+            auto ptr = new _Pools;
+            at_fork({
+                [] {
+                    auto& s = get();
+                    s.mutex.lock();
+                    if (auto pool = s.pool.load())
+                        pool->_mutex.lock();
+                },
+                [] {
+                    auto& s = get();
+                    if (auto pool = s.pool.load())
+                        pool->_mutex.unlock();
+                    s.mutex.unlock();
+                },
+                [] {
+                    auto& s = get();
+                    if (auto pool = s.pool.exchange(nullptr)) {
+                        pool->_mutex.unlock();
+                        delete pool;
+                    }
+                    s.mutex.unlock();
+                },
+            });
+            return ptr;
+        }();
+        return *state;
+    }
+};
+
+} // namespace _detail
+
+/// Process-wide pool for decoding, created on first use.
+/// Child of fork discards one of parent and gets its own.
+inline ThreadPool& thread_pool() {
+    auto& state = _detail::_Pools::get();
+    if (auto ptr = state.pool.load(std::memory_order_acquire))
+        return *ptr;
+
+    std::unique_lock lk{state.mutex};
+    auto ptr = state.pool.load(std::memory_order_relaxed);
+    if (!ptr) {
+        ptr = new ThreadPool;
+        state.pool.store(ptr, std::memory_order_release);
+    }
+    return *ptr;
+}
+
+} // namespace ts
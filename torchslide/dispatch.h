@@ -1,9 +1,14 @@
 #pragma once
 
+#include <algorithm>
+
 #include <pybind11/pybind11.h>
 #include <pybind11/numpy.h>
 
+#include "core/thread_pool.h"
+#include "resample.h"
 #include "tensor.h"
+#include "tissue.h"
 #include "image.h"
 
 namespace py = pybind11;
@@ -20,28 +25,183 @@ struct Dispatch : Image::Register<Impl> {
     virtual py::buffer read_any(Box const& box) const final {
         py::gil_scoped_release no_gil;
         return std::visit(
-            [this, &box](auto v) {
-                return as_buffer(
-                    this->derived()->template read<decltype(v)>(box)
-                );
+            [](auto&& t) -> py::buffer { return as_buffer(std::move(t)); },
+            this->read_tensor_any(box, {}));
+    }
+
+    /// Reads `box`, then downsamples it to `area.shape` with area filter
+    virtual py::buffer
+    read_area_any(Box const& box, Area const& area) const final {
+        py::gil_scoped_release no_gil;
+        return std::visit(
+            [](auto&& t) -> py::buffer { return as_buffer(std::move(t)); },
+            this->read_tensor_any(box, area));
+    }
+
+    /// Same as `read_any` or `read_area_any`, but called without GIL
+    /// and gives tensor, i.e. for background reads
+    virtual AnyTensor read_tensor_any(
+        Box const& box, std::optional<Area> const& area) const final {
+        NoFork no_fork;
+        return std::visit(
+            [this, &box, &area](auto v) -> AnyTensor {
+                using T = decltype(v);
+                auto src = this->derived()->template read<T>(box);
+                if (!area)
+                    return src;
+                Tensor<T> out{
+                    {area->shape[0], area->shape[1], this->samples}};
+                resize_area(src, out, *area);
+                return out;
+            },
+            this->dtype);
+    }
+
+    /// Same as `read_any`, but writes to caller-provided buffer.
+    /// Buffer must be C-contiguous, of image's dtype and (H, W, samples) shape
+    virtual void
+    read_into_any(Box const& box, py::buffer_info& out) const final {
+        std::visit(
+            [this, &box, &out](auto v) {
+                using T = decltype(v);
+                _check_buffer<T>(box, out);
+
+                py::gil_scoped_release no_gil;
+                NoFork no_fork;
+                Tensor<T> t{
+                    {box.shape(0), box.shape(1), this->samples},
+                    static_cast<T*>(out.ptr)};
+                this->derived()->template read_into<T>(box, t);
+            },
+            this->dtype);
+    }
+
+    /// Reads equally-sized boxes of the same level into (N, H, W, samples)
+    /// array, in single call without GIL
+    virtual py::buffer
+    read_batch_any(std::vector<Box> const& boxes) const final {
+        py::gil_scoped_release no_gil;
+        return std::visit(
+            [this, &boxes](auto v) {
+                using T = decltype(v);
+                Tensor<T> out{{
+                    static_cast<Size>(boxes.size()),
+                    boxes.empty() ? 0 : boxes.front().shape(0),
+                    boxes.empty() ? 0 : boxes.front().shape(1),
+                    this->samples}};
+                {
+                    NoFork no_fork;
+                    this->derived()->template read_batch<T>(boxes, out);
+                }
+                return as_buffer(std::move(out));
+            },
+            this->dtype);
+    }
+
+    /// Warms caches for boxes which will be read soon. Called without GIL.
+    virtual void prefetch_any(std::vector<Box> const& boxes) const final {
+        NoFork no_fork;
+        std::visit(
+            [this, &boxes](auto v) {
+                this->derived()->template prefetch<decltype(v)>(boxes);
             },
             this->dtype);
     }
 
+    /// Reads image at `tissue_side` resolution from the coarsest source
+    /// which has it, and finds foreground in it. Called without GIL.
+    virtual TissueMask find_tissue_any() const final {
+        auto const& base = this->levels.at(0).shape;
+        auto const target = std::max(
+            ceil(std::max(base[0], base[1]), tissue_side) / tissue_side,
+            Size{1});
+        auto const [level, reduce, scale] = this->get_source(target);
+        auto const shape = this->levels.at(level).reduced(reduce).shape;
+        Box box{{0, 0}, {shape[0], shape[1]}, level, reduce};
+
+        std::optional<Area> area;
+        if (scale < target)
+            area = Area{
+                {0, 0},
+                {target, target},
+                scale,
+                {ceil(shape[0] * scale, target) / target,
+                 ceil(shape[1] * scale, target) / target}};
+        return std::visit(
+            [](auto const& t) { return find_tissue(t); },
+            this->read_tensor_any(box, area));
+    }
+
     template <typename T>
     Tensor<T> read(Box const& box) const;
 
+    template <typename T>
+    void read_into(Box const& box, Tensor<T>& out) const;
+
+    /// Fallback for implementations without shared tile decoding,
+    /// reads boxes independently in parallel.
+    template <typename T>
+    void read_batch(std::vector<Box> const& boxes, Tensor<T>& out) const {
+        if (boxes.empty())
+            return;
+        auto stride = boxes.front().area() * this->samples;
+        thread_pool().parallel_for(boxes.size(), [&](size_t i) {
+            Tensor<T> o{
+                {boxes[i].shape(0), boxes[i].shape(1), this->samples},
+                out.data() + i * stride};
+            this->derived()->template read_into<T>(boxes[i], o);
+        });
+    }
+
+    /// Fallback for implementations without tile cache of their own,
+    /// reads boxes and drops the result.
+    template <typename T>
+    void prefetch(std::vector<Box> const& boxes) const {
+        thread_pool().parallel_for(boxes.size(), [&](size_t i) {
+            this->derived()->template read<T>(boxes[i]);
+        });
+    }
+
 private:
     auto* derived() const noexcept { return static_cast<Impl const*>(this); }
+
+    template <typename T>
+    void _check_buffer(Box const& box, py::buffer_info const& out) const {
+        if (out.readonly)
+            throw std::runtime_error{"Buffer is not writable"};
+
+        py::dtype dtype{out};
+        auto kind = std::is_floating_point_v<T> ? 'f' : 'u';
+        if (dtype.kind() != kind || dtype.itemsize() != sizeof(T))
+            throw std::runtime_error{"Buffer dtype mismatch"};
+
+        std::vector<py::ssize_t> shape
+            = {box.shape(0), box.shape(1), this->samples};
+        if (out.shape != shape)
+            throw std::runtime_error{"Buffer shape mismatch"};
+
+        auto stride = static_cast<py::ssize_t>(sizeof(T));
+        for (auto i = out.ndim; i-- > 0; stride *= out.shape[i])
+            if (out.strides[i] != stride && out.shape[i] != 1)
+                throw std::runtime_error{"Buffer is not C-contiguous"};
+    }
 };
 
+template <typename T>
+py::buffer as_buffer(Tensor<T> const& t) noexcept;
+
+/// Moves storage into capsule owned by NumPy array, so no copy is made
 template <typename T>
 py::buffer as_buffer(Tensor<T>&& t) noexcept {
-    auto ptr = new auto(t.storage());
+    if (!t.owns())
+        return as_buffer(std::as_const(t));
+
+    auto shape = std::move(t).shape();
+    auto ptr = new auto(std::move(t).storage());
 
     py::gil_scoped_acquire with_gil;
     return py::array_t<T, py::array::c_style | py::array::forcecast>{
-        std::move(t.shape()),
+        std::move(shape),
         ptr->data(),
         py::capsule(ptr, [](void* p) {
             delete reinterpret_cast<decltype(ptr)>(p);
@@ -2,10 +2,12 @@
 #include "al/image.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <math.h>
-#include <sstream>
 
 
 extern "C" {
@@ -18,9 +20,167 @@ extern "C" {
 
 namespace gs {
 
+namespace {
+
+/// In-memory file for libtiff, to encode tiles without touching disk
+struct MemoryFile {
+    std::vector<uint8_t> data = {};
+    toff_t pos = 0;
+};
+
+tsize_t mem_read(thandle_t h, tdata_t buf, tsize_t size) {
+    auto& f = *static_cast<MemoryFile*>(h);
+    auto pos = std::min<toff_t>(f.pos, f.data.size());
+    auto n = std::min<toff_t>(size, f.data.size() - pos);
+    std::memcpy(buf, f.data.data() + pos, n);
+    f.pos += n;
+    return static_cast<tsize_t>(n);
+}
+
+tsize_t mem_write(thandle_t h, tdata_t buf, tsize_t size) {
+    auto& f = *static_cast<MemoryFile*>(h);
+    if (f.pos + size > f.data.size())
+        f.data.resize(f.pos + size);
+    std::memcpy(f.data.data() + f.pos, buf, size);
+    f.pos += size;
+    return size;
+}
+
+toff_t mem_seek(thandle_t h, toff_t off, int whence) {
+    auto& f = *static_cast<MemoryFile*>(h);
+    if (whence == SEEK_CUR)
+        off += f.pos;
+    else if (whence == SEEK_END)
+        off += f.data.size();
+    return f.pos = off;
+}
+
+int mem_close(thandle_t) { return 0; }
+
+toff_t mem_size(thandle_t h) {
+    return static_cast<MemoryFile*>(h)->data.size();
+}
+
+int mem_map(thandle_t, tdata_t*, toff_t*) { return 0; }
+
+void mem_unmap(thandle_t, tdata_t, toff_t) {}
+
+/// Output may be over 2GB, beyond `long` of `fseek` on Windows
+int seek(std::FILE* file, uint64_t offset, int whence) {
+#ifdef _WIN32
+    return _fseeki64(file, static_cast<int64_t>(offset), whence);
+#else
+    return fseeko(file, static_cast<off_t>(offset), whence);
+#endif
+}
+
+uint64_t tell(std::FILE* file) {
+#ifdef _WIN32
+    return static_cast<uint64_t>(_ftelli64(file));
+#else
+    return static_cast<uint64_t>(ftello(file));
+#endif
+}
+
+/// Appends BigTIFF IFDs to file written by libtiff, in its byte order
+struct IfdWriter {
+    std::FILE* file;
+    bool big_endian;
+
+    struct Entry {
+        uint16_t tag;
+        uint16_t type;
+        uint64_t count;
+        std::vector<uint8_t> data;
+    };
+    std::vector<Entry> entries = {};
+
+    void put(std::vector<uint8_t>& out, uint64_t value, size_t bytes) const {
+        for (size_t i = 0; i < bytes; ++i) {
+            auto shift = 8 * (big_endian ? bytes - 1 - i : i);
+            out.push_back(static_cast<uint8_t>(value >> shift));
+        }
+    }
+
+    uint64_t read(uint64_t offset) const {
+        uint8_t bytes[8];
+        if (seek(file, offset, SEEK_SET) || std::fread(bytes, 1, 8, file) != 8)
+            throw std::runtime_error{"Failed to read TIFF"};
+        uint64_t value = 0;
+        for (size_t i = 0; i < 8; ++i)
+            value |= uint64_t{bytes[i]} << 8 * (big_endian ? 7 - i : i);
+        return value;
+    }
+
+    void write(uint64_t offset, std::vector<uint8_t> const& bytes) const {
+        if (seek(file, offset, SEEK_SET)
+            || std::fwrite(bytes.data(), 1, bytes.size(), file)
+                   != bytes.size())
+            throw std::runtime_error{"Failed to write TIFF"};
+    }
+
+    /// Writes at end of file on word boundary, returns offset
+    uint64_t append(std::vector<uint8_t> const& bytes) const {
+        if (seek(file, 0, SEEK_END))
+            throw std::runtime_error{"Failed to write TIFF"};
+        auto offset = tell(file);
+        if (offset % 2)
+            write(offset++, {0});
+        write(offset, bytes);
+        return offset;
+    }
+
+    void add(uint16_t tag, uint16_t type, std::vector<uint64_t> const& values) {
+        size_t bytes = (type == TIFF_SHORT) ? 2 : (type == TIFF_LONG) ? 4 : 8;
+        Entry entry{tag, type, values.size(), {}};
+        for (auto value : values)
+            put(entry.data, value, bytes);
+        entries.push_back(std::move(entry));
+    }
+
+    void add_rational(uint16_t tag, double value) {
+        Entry entry{tag, TIFF_RATIONAL, 1, {}};
+        put(entry.data, static_cast<uint32_t>(std::lround(value * 1000)), 4);
+        put(entry.data, 1000, 4);
+        entries.push_back(std::move(entry));
+    }
+
+    /// Appends IFD of added tags, values not fitting entries go before it.
+    /// Returns its offset and offset of its link to next IFD.
+    std::pair<uint64_t, uint64_t> flush() {
+        std::sort(
+            entries.begin(), entries.end(), [](auto const& a, auto const& b) {
+                return a.tag < b.tag;
+            });
+        std::vector<uint8_t> ifd;
+        put(ifd, entries.size(), 8);
+        for (auto& entry : entries) {
+            if (entry.data.size() > 8) {
+                auto offset = append(entry.data);
+                entry.data.clear();
+                put(entry.data, offset, 8);
+            }
+            entry.data.resize(8);
+            put(ifd, entry.tag, 2);
+            put(ifd, entry.type, 2);
+            put(ifd, entry.count, 8);
+            ifd.insert(ifd.end(), entry.data.begin(), entry.data.end());
+        }
+        put(ifd, 0, 8);
+        entries.clear();
+        auto offset = append(ifd);
+        return {offset, offset + ifd.size() - 8};
+    }
+};
+
+} // namespace
+
 Writer::Writer(std::string const& filename)
   : filename_{filename}
-  , tiff_{filename, "w8"} {
+  , tiff_{filename, "w8"}
+  , out_{std::fopen(filename.c_str(), "r+b"), std::fclose} {
+    if (!out_)
+        throw std::runtime_error{"Failed to open " + filename};
     TIFFSetWarningHandler(nullptr);
 }
 
@@ -32,7 +192,7 @@ void Writer::spacing(std::vector<double>& spacing_) {
     }
 }
 
-void ImageWriter::write_image(const Image& image) {
+void Writer::write_image(const Image& image) {
     ctype(image.ctype());
     if (image.ctype() == Color::Indexed)
         indexed_colors(image.samples());
@@ -49,17 +209,17 @@ void ImageWriter::write_image(const Image& image) {
             switch (dtype_) {
             case Data::UInt32: {
                 auto data = image.template read<uint32_t>(y, x, tile_size_, tile_size_);
-                this->append(data);
+                this->append(std::move(data));
                 break;
             }
             case Data::UInt16: {
                 auto data = image.template read<uint16_t>(y, x, tile_size_, tile_size_);
-                this->append(data);
+                this->append(std::move(data));
                 break;
             }
             case Data::UInt8: {
                 auto data = image.template read<uint8_t>(y, x, tile_size_, tile_size_);
-                this->append(data);
+                this->append(std::move(data));
                 break;
             }
             default:
@@ -68,244 +228,218 @@ void ImageWriter::write_image(const Image& image) {
     this->close();
 }
 
-void ImageWriter::size(size_t size_y, size_t size_x) {
+void Writer::size(size_t size_y, size_t size_x) {
     min_vals_ = std::vector(cdepth_, std::numeric_limits<double>::max());
     max_vals_ = std::vector(cdepth_, std::numeric_limits<double>::min());
 
     pyramid_tags(tiff_, size_y, size_x);
-    // size_t total_steps = (size_y / tile_size_) * (size_x / tile_size_);
-}
-
-void ImageWriter::close() {
-    tiff_.field(TIFFTAG_PERSAMPLE, PERSAMPLE_MULTI);
-    tiff_.field(TIFFTAG_PERSAMPLE, PERSAMPLE_MULTI);
-    tiff_.field(TIFFTAG_SMINSAMPLEVALUE, min_vals_.data());
-    tiff_.field(TIFFTAG_SMAXSAMPLEVALUE, max_vals_.data());
-
-    /* Reset to default behavior, if needed. */
-    tiff_.field(TIFFTAG_PERSAMPLE, PERSAMPLE_MERGED);
-    if (dtype_ == Data::UInt32) {
-        write_pyramid_to_disk<uint32_t>();
-        incorporate_pyramid<uint32_t>();
-    } else if (dtype_ == Data::UInt16) {
-        write_pyramid_to_disk<uint16_t>();
-        incorporate_pyramid<uint16_t>();
-    } else if (dtype_ == Data::UInt8) {
-        write_pyramid_to_disk<uint8_t>();
-        incorporate_pyramid<uint8_t>();
-    } else {
-        write_pyramid_to_disk<float>();
-        incorporate_pyramid<float>();
+    plan_levels(size_y, size_x);
+
+    format_ = {
+        tiff_.field(TIFFTAG_COMPRESSION),
+        tiff_.field(TIFFTAG_PHOTOMETRIC),
+        tiff_.field(TIFFTAG_BITSPERSAMPLE),
+        tiff_.field(TIFFTAG_SAMPLEFORMAT),
+        tiff_.field(TIFFTAG_SAMPLESPERPIXEL),
+        static_cast<uint32_t>(tile_size_),
+        static_cast<int>(quality_),
+    };
+    /// Pseudo-tags exist only while their codec is set
+    if (format_.compression == COMPRESSION_JPEG) {
+        format_.quality = tiff_.field(TIFFTAG_JPEGQUALITY);
+        format_.jpeg_color_mode = tiff_.field(TIFFTAG_JPEGCOLORMODE);
     }
-
-    for (auto& it : level_files_)
-        for (size_t i = 0; i < 5; ++i)
-            if (remove(it.c_str()) == 0)
-                break;
+    if (format_.compression == COMPRESSION_LZW
+        || format_.compression == COMPRESSION_ADOBE_DEFLATE)
+        format_.predictor = tiff_.field(TIFFTAG_PREDICTOR);
 }
 
-template <typename T>
-void ImageWriter::write_pyramid_to_disk() {
-    //! First get the overall image width and height;
-
-    // TIFF idiosyncracy, when setting resolution tags one uses doubles,
-    // getting them requires floats
-    size_t h = tiff_.field(TIFFTAG_IMAGELENGTH);
-    size_t w = tiff_.field(TIFFTAG_IMAGEWIDTH);
-
-    size_t samples = tiff_.field(TIFFTAG_SAMPLESPERPIXEL);
-
-    size_t bits = tiff_.field(TIFFTAG_BITSPERSAMPLE);
-
-    std::vector<double> spacing{
-        10000. / tiff_.template field<float>(TIFFTAG_YRESOLUTION),
-        10000. / tiff_.template field<field>(TIFFTAG_XRESOLUTION),
-    };
-    // Determine the amount of pyramid levels
+void Writer::plan_levels(size_t height, size_t width) {
     size_t levels = 1;
-    size_t lowestwidth = w;
-
+    size_t lowestwidth = width;
     while (lowestwidth > 1024) {
         lowestwidth /= 2;
         ++levels;
     }
-    if (abs(1024. - lowestwidth) > abs(1024. - lowestwidth * 2)) {
-        lowestwidth *= 2;
+    if (abs(1024. - lowestwidth) > abs(1024. - lowestwidth * 2))
         --levels;
+
+    levels_.clear();
+    levels_.resize(levels + 1);
+    written_.assign(
+        ((height + tile_size_ - 1) / tile_size_)
+            * ((width + tile_size_ - 1) / tile_size_),
+        false);
+    for (size_t level = 0; level <= levels; ++level) {
+        auto& info = levels_[level];
+        info.height = height >> level;
+        info.width = width >> level;
+        info.tiles_y = (info.height + tile_size_ - 1) / tile_size_;
+        info.tiles_x = (info.width + tile_size_ - 1) / tile_size_;
+        if (level)
+            info.tiles.resize(info.tiles_y * info.tiles_x);
+    }
+}
+
+std::vector<uint8_t> Writer::encode_tile(void const* data, size_t size) const {
+    if (codec_ == Codec::JPEG2000)
+        return jp2k::encode(
+            reinterpret_cast<char*>(const_cast<void*>(data)), size,
+            tile_size_, quality_,
+            cdepth_, dtype_, ctype_);
+
+    /// Single-tile TIFF in memory, its only tile is result
+    MemoryFile file;
+    auto tif = TIFFClientOpen(
+        "memory", "w", &file, mem_read, mem_write, mem_seek, mem_close,
+        mem_size, mem_map, mem_unmap);
+    if (!tif)
+        throw std::runtime_error{"Failed to encode tile"};
+
+    auto const& f = format_;
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, f.tile_size);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, f.tile_size);
+    TIFFSetField(tif, TIFFTAG_TILEWIDTH, f.tile_size);
+    TIFFSetField(tif, TIFFTAG_TILELENGTH, f.tile_size);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, f.photometric);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, f.bits);
+    TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, f.sample_format);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, f.samples);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, f.compression);
+    if (f.compression == COMPRESSION_JPEG) {
+        TIFFSetField(tif, TIFFTAG_JPEGQUALITY, f.quality);
+        TIFFSetField(tif, TIFFTAG_JPEGCOLORMODE, f.jpeg_color_mode);
+        TIFFSetField(tif, TIFFTAG_JPEGTABLESMODE, 0);
+    }
+    if (f.predictor != PREDICTOR_NONE)
+        TIFFSetField(tif, TIFFTAG_PREDICTOR, f.predictor);
+
+    std::vector<uint8_t> result;
+    if (TIFFWriteEncodedTile(tif, 0, const_cast<void*>(data), size) >= 0) {
+        uint64_t* offsets = nullptr;
+        uint64_t* bytecounts = nullptr;
+        if (TIFFGetField(tif, TIFFTAG_TILEOFFSETS, &offsets)
+            && TIFFGetField(tif, TIFFTAG_TILEBYTECOUNTS, &bytecounts)
+            && offsets[0] + bytecounts[0] <= file.data.size())
+            result.assign(
+                file.data.begin() + offsets[0],
+                file.data.begin() + offsets[0] + bytecounts[0]);
     }
-    // Setup the image directory for the thumbnail
-    size_t lowestheight = (size_t)(h / pow(2.0, (double)levels));
+    TIFFClose(tif);
+    if (result.empty())
+        throw std::runtime_error{"Failed to encode tile"};
+    return result;
+}
 
-    // Write temporary image to store previous level (LibTiff does not allow to go back and forth between
-    // empty directories
-#ifdef WIN32
-    size_t found = filename_.find_last_of("/\\");
-#else
-    size_t found = filename_.find_last_of("/");
-#endif
-    std::string tmppath = filename_.substr(0, found + 1);
-    std::string filename = filename_.substr(found + 1);
-    std::string basename = filename.substr(0, filename.find_last_of("."));
-    for (size_t level = 1; level <= levels; ++level) {
-        TiffFile prev_level_tiff;
-        if (level == 1)
-            prev_level_tiff = tiff_;
+void Writer::flush(bool all) {
+    size_t limit = all ? 0 : 2 * ts::thread_pool().size();
+    while (!queue_.empty()) {
+        auto& [level, pos, encoded] = queue_.front();
+        if (queue_.size() <= limit
+            && encoded.wait_for(std::chrono::seconds{0})
+                   != std::future_status::ready)
+            break;
+        auto bytes = encoded.get();
+        if (!level)
+            tiff_.write_raw(pos, bytes);
         else {
-            std::stringstream ssm;
-            ssm << tmppath << "temp" << basename << "Level" << level - 1
-                << ".tif";
-            prev_level_tiff = tiff_open(ssm.str(), "r");
+            /// libtiff seeks to end for each new tile, so appends of
+            /// both handles never overlap once this one is flushed
+            auto file = out_.get();
+            if (seek(file, 0, SEEK_END))
+                throw std::runtime_error{"Failed to write pyramid tile"};
+            auto offset = tell(file);
+            if (std::fwrite(bytes.data(), 1, bytes.size(), file)
+                    != bytes.size()
+                || std::fflush(file))
+                throw std::runtime_error{"Failed to write pyramid tile"};
+            levels_[level].tiles[pos] = {offset, bytes.size()};
         }
-        std::stringstream ssm;
-        ssm << tmppath << "temp" << basename << "Level" << level << ".tif";
-        auto level_tiff = tiff_open(ssm.str(), "w8");
-        level_files_.push_back(ssm.str());
-
-        size_t level_h = (size_t)(h / pow(2., (double)level));
-        size_t level_w = (size_t)(w / pow(2., (double)level));
-        size_t prev_level_h = (size_t)(h / pow(2., (double)level - 1));
-        size_t prev_level_w = (size_t)(w / pow(2., (double)level - 1));
-
-        temp_pyramid_tags(level_tiff, level_w, level_h);
-        size_t tiles_y = (size_t)ceil(float{level_h} / tile_size_);
-        size_t tiles_x = (size_t)ceil(float{level_w} / tile_size_);
-        size_t level_tiles = tiles_y * tiles_x;
-        size_t pixels = tile_size_ * tile_size_ * samples;
-        int row = -2, col = 0;
-        for (size_t i = 0; i < level_tiles; ++i) {
-            if (i % tiles_x == 0) {
-                row += 2;
-                col = 0;
-            }
-            size_t ypos = tile_size_ * row;
-            size_t xpos = tile_size_ * col;
-            auto tile00 = tiff_new<T>(pixels);
-            auto tile01 = tiff_new<T>(pixels);
-            auto tile10 = tiff_new<T>(pixels);
-            auto tile11 = tiff_new<T>(pixels);
-            auto out_tile = tiff_new<T>(pixels);
-            bool valid[2][2]{};
-            size_t size = pixels * sizeof(T);
-            if (level == 1 && codec_ == Codec::JPEG2000) {
-                size_t out_tile_size = tile_size_ * tile_size_ * samples * (bits / 8);
-
-                if (TIFFReadRawTile(
-                        prev_level_tiff.get(),
-                        prev_level_tiff.position(ypos, xpos),
-                        tile00.get(),
-                        out_tile_size) > 0)
-                    valid[0][0] = true;
-                else
-                    std::fill_n(tile00, pixels, 0);
-
-                if (xpos + tile_size_ >= prev_level_w)
-                    std::fill_n(tile00, pixels, 0);
-                else {
-                    if (TIFFReadRawTile(
-                            prev_level_tiff.get(),
-                            prev_level_tiff.position(ypos, xpos + tile_size_),
-                            tile01.get(),
-                            out_tile_size) > 0)
-                        valid[0][1] = true;
-                    else
-                        std::fill_n(tile00, pixels, 0);
-                }
-                if (ypos + _tileSize >= prevLevelh)
-                    std::fill_n(tile3, npixels, 0);
-                else {
-                    tileNr = TIFFComputeTile(
-                        prevLevelTiff, xpos, ypos + _tileSize, 0, 0);
-                    int rawSize = TIFFReadRawTile(
-                        prevLevelTiff, tileNr, tile3, outTileSize);
-                    if (rawSize > 0)
-                        valid[1][0] = true;
-                    else {
-                        std::fill_n(tile3, npixels, 0);
-                    }
-                }
-                if (xpos + _tileSize >= prevLevelw || ypos + _tileSize >= prevLevelh)
-                    std::fill_n(tile4, npixels, 0);
-                else {
-                    tileNr = TIFFComputeTile(prevLevelTiff, xpos + _tileSize, ypos + _tileSize, 0, 0);
-                    int rawSize = TIFFReadRawTile(prevLevelTiff, tileNr, tile4, outTileSize);
-                    if (rawSize > 0)
-                        valid[1][1] = true;
-                    else
-                        std::fill_n(tile4, npixels, 0);
-                }
-            } else {
-                if (TIFFReadTile(prevLevelTiff, tile1, xpos, ypos, 0, 0) < 0)
-                    std::fill_n(tile00, pixels, 0);
-                else
-                    valid[0][0] = true;
-
-                if (xpos + _tileSize >= prevLevelw)
-                    std::fill_n(tile01, pixels, 0);
-                else {
-                    if (TIFFReadTile(prevLevelTiff, tile2, xpos + _tileSize, ypos, 0, 0) < 0)
-                        std::fill_n(tile2, npixels, 0);
-                    else
-                        valid[0][1] = true;
-                }
-                if (ypos + _tileSize >= prevLevelh)
-                    std::fill_n(tile3, npixels, 0);
-                else {
-                    if (TIFFReadTile(prevLevelTiff, tile3, xpos, ypos + _tileSize, 0, 0) < 0)
-                        std::fill_n(tile3, npixels, 0);
-                    else
-                        valid[1][0] = true;
-                }
-                if (xpos + _tileSize >= prevLevelw || ypos + _tileSize >= prevLevelh)
-                    std::fill_n(tile4, npixels, 0);
-                else {
-                    if (TIFFReadTile(prevLevelTiff, tile4, xpos + _tileSize, ypos + _tileSize, 0, 0) < 0)
-                        std::fill_n(tile4, npixels, 0);
-                    else
-                        valid[1][1] = true;
-                }
-            }
-            if (valid[0][0] || valid[0][1] || valid[1][0] || valid[1][1]) {
-                auto dsTile00 = downscale_tile(tile00, tile_size_, samples);
-                auto dsTile01 = downscale_tile(tile01, tile_size_, samples);
-                auto dsTile10 = downscale_tile(tile10, tile_size_, samples);
-                auto dsTile11 = downscale_tile(tile11, tile_size_, samples);
-                unsigned int dsSize = _tileSize / 2;
-                for (unsigned int y = 0; y < _tileSize; ++y)
-                    for (unsigned int x = 0; x < _tileSize; ++x)
-                        for (unsigned int s = 0; s < nrsamples; ++s) {
-                            unsigned int outIndex = nrsamples * (y * _tileSize + x) + s;
-                            T* usedTile = dsTile1;
-                            unsigned int inIndex = y * dsSize * nrsamples + x * nrsamples + s;
-                            if (x >= dsSize && y < dsSize) {
-                                usedTile = dsTile2;
-                                inIndex = y * dsSize * nrsamples + ((x - dsSize) * nrsamples) + s;
-                            } else if (x < dsSize && y >= dsSize) {
-                                usedTile = dsTile3;
-                                inIndex = (y - dsSize) * dsSize * nrsamples + x * nrsamples + s;
-                            } else if (x >= dsSize && y >= dsSize) {
-                                usedTile = dsTile4;
-                                inIndex = (y - dsSize) * dsSize * nrsamples + (x - dsSize) * nrsamples + s;
-                            }
-                            T val = *(usedTile + inIndex);
-                            *(outTile + outIndex) = val;
-                        }
-                TIFFWriteEncodedTile(level_tiff.get(), i, out_tile, pixels * sizeof(T));
-            }
-            col += 2;
-        }
-        TIFFSetField(tiff_, TIFFTAG_RESOLUTIONUNIT, RESUNIT_CENTIMETER);
-        if (!spacing.empty()) {
-            spacing[0] *= 2.;
-            spacing[1] *= 2.;
-            TIFFSetField(levelTiff, TIFFTAG_YRESOLUTION, 10000. / spacing[0]);
-            TIFFSetField(levelTiff, TIFFTAG_XRESOLUTION, 10000. / spacing[1]);
+        queue_.pop_front();
+    }
+}
+
+void Writer::write_levels(std::vector<double> spacing) {
+    /// Closes file, libtiff has nothing more to write after base directory
+    tiff_ = {};
+
+    auto file = out_.get();
+    uint8_t order = 0;
+    if (seek(file, 0, SEEK_SET) || std::fread(&order, 1, 1, file) != 1)
+        throw std::runtime_error{"Failed to read TIFF"};
+    IfdWriter ifd{file, order == 'M'};
+
+    /// Base directory is the only one, so header points to it
+    auto base = ifd.read(8);
+    auto link = base + 8 + ifd.read(base) * 20;
+
+    auto const& f = format_;
+    for (size_t level = 1; level < levels_.size(); ++level) {
+        auto const& info = levels_[level];
+        spacing[0] *= 2.;
+        spacing[1] *= 2.;
+
+        std::vector<uint64_t> offsets;
+        std::vector<uint64_t> sizes;
+        for (auto [offset, size] : info.tiles) {
+            offsets.push_back(offset);
+            sizes.push_back(size);
         }
+        ifd.add(TIFFTAG_SUBFILETYPE, TIFF_LONG, {FILETYPE_REDUCEDIMAGE});
+        ifd.add(TIFFTAG_IMAGEWIDTH, TIFF_LONG, {info.width});
+        ifd.add(TIFFTAG_IMAGELENGTH, TIFF_LONG, {info.height});
+        ifd.add(
+            TIFFTAG_BITSPERSAMPLE,
+            TIFF_SHORT,
+            std::vector<uint64_t>(f.samples, f.bits));
+        ifd.add(TIFFTAG_COMPRESSION, TIFF_SHORT, {f.compression});
+        ifd.add(TIFFTAG_PHOTOMETRIC, TIFF_SHORT, {f.photometric});
+        ifd.add(TIFFTAG_ORIENTATION, TIFF_SHORT, {ORIENTATION_TOPLEFT});
+        ifd.add(TIFFTAG_SAMPLESPERPIXEL, TIFF_SHORT, {f.samples});
+        ifd.add_rational(TIFFTAG_YRESOLUTION, 10000. / spacing[0]);
+        ifd.add_rational(TIFFTAG_XRESOLUTION, 10000. / spacing[1]);
+        ifd.add(TIFFTAG_PLANARCONFIG, TIFF_SHORT, {PLANARCONFIG_CONTIG});
+        ifd.add(TIFFTAG_RESOLUTIONUNIT, TIFF_SHORT, {RESUNIT_CENTIMETER});
+        if (f.predictor != PREDICTOR_NONE)
+            ifd.add(TIFFTAG_PREDICTOR, TIFF_SHORT, {f.predictor});
+        ifd.add(TIFFTAG_TILEWIDTH, TIFF_LONG, {f.tile_size});
+        ifd.add(TIFFTAG_TILELENGTH, TIFF_LONG, {f.tile_size});
+        ifd.add(TIFFTAG_TILEOFFSETS, TIFF_LONG8, offsets);
+        ifd.add(TIFFTAG_TILEBYTECOUNTS, TIFF_LONG8, sizes);
+        ifd.add(
+            TIFFTAG_SAMPLEFORMAT,
+            TIFF_SHORT,
+            std::vector<uint64_t>(f.samples, f.sample_format));
+
+        auto [offset, next] = ifd.flush();
+        std::vector<uint8_t> bytes;
+        ifd.put(bytes, offset, 8);
+        ifd.write(link, bytes);
+        link = next;
     }
-    //! Write base directory to disk
-    TIFFWriteDirectory(tiff_);
+    out_.reset();
 }
 
-void ImageWriter::base_tags(TiffFile& level_tiff) {
+void Writer::close() {
+    tiff_.field(TIFFTAG_PERSAMPLE, PERSAMPLE_MULTI);
+    tiff_.field(TIFFTAG_PERSAMPLE, PERSAMPLE_MULTI);
+    tiff_.field(TIFFTAG_SMINSAMPLEVALUE, min_vals_.data());
+    tiff_.field(TIFFTAG_SMAXSAMPLEVALUE, max_vals_.data());
+
+    /* Reset to default behavior, if needed. */
+    tiff_.field(TIFFTAG_PERSAMPLE, PERSAMPLE_MERGED);
+    if (dtype_ == Data::UInt32)
+        write_pyramid<uint32_t>();
+    else if (dtype_ == Data::UInt16)
+        write_pyramid<uint16_t>();
+    else if (dtype_ == Data::UInt8)
+        write_pyramid<uint8_t>();
+    else
+        write_pyramid<float>();
+}
+
+void Writer::base_tags(TiffFile& level_tiff) {
     if (ctype_ == Color::Monochrome || ctype_ == Color::Indexed)
         level_tiff.field(TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
     else if (ctype_ == Color::ARGB || ctype_ == Color::RGB)
@@ -324,7 +458,7 @@ void ImageWriter::base_tags(TiffFile& level_tiff) {
     level_tiff.field(TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
 }
 
-void ImageWriter::pyramid_tags(TiffFile& level_tiff, size_t height, size_t width) {
+void Writer::pyramid_tags(TiffFile& level_tiff, size_t height, size_t width) {
     base_tags(level_tiff);
 
     switch (codec_) {
@@ -334,6 +468,8 @@ void ImageWriter::pyramid_tags(TiffFile& level_tiff, size_t height, size_t width
     case Codec::JPEG: {
         level_tiff.field(TIFFTAG_COMPRESSION, COMPRESSION_JPEG);
         level_tiff.field(TIFFTAG_JPEGQUALITY, static_cast<uint32_t>(quality_));
+        /// Tiles are encoded apart as complete JPEGs, without shared tables
+        level_tiff.field(TIFFTAG_JPEGTABLESMODE, 0);
         break;
     }
     case Codec::RAW:
@@ -352,15 +488,4 @@ void ImageWriter::pyramid_tags(TiffFile& level_tiff, size_t height, size_t width
     level_tiff.field(TIFFTAG_IMAGELENGTH, height);
 }
 
-void ImageWriter::temp_pyramid_tags(
-    TiffFile& level_tiff, size_t height, size_t width
-) {
-    base_tags(level_tiff);
-    level_tiff.field(TIFFTAG_COMPRESSION, COMPRESSION_LZW);
-    level_tiff.field(TIFFTAG_TILEWIDTH, tile_size_);
-    level_tiff.field(TIFFTAG_TILELENGTH, tile_size_);
-    level_tiff.field(TIFFTAG_IMAGEWIDTH, width);
-    level_tiff.field(TIFFTAG_IMAGELENGTH, height);
-}
-
 } // namespace gs
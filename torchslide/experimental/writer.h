@@ -1,12 +1,20 @@
 #pragma once
 
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 #include "enums.h"
 #include "codecs/tiff_tools.h"
 #include "image.h"
+#include "core/thread_pool.h"
 
 class JPEG2000Codec;
 
@@ -17,6 +25,11 @@ class JPEG2000Codec;
 //! the pyramid (finishImage). The class also contains a convenience function (writeImage),
 //! which writes an entire Image to disk using the image properties (color, data)
 //! and the specified codec.
+//!
+//! Not built with the module: it depends on headers of the original library
+//! (enums.h, codecs/tiff_tools.h) which are not part of this tree. Only the
+//! layout of reduced levels (`write_levels`) was checked against libtiff on
+//! its own, the rest is unverified.
 
 namespace gs {
 
@@ -36,47 +49,103 @@ protected:
     /// Positions in currently opened file
     size_t pos_ = 0;
 
-    /// Temporary storage for the levelFiles
-    std::vector<std::filesystem::path> level_files_ = {};
     TiffFile tiff_ = {};
+    /// Second handle to output. Tiles of reduced levels are appended
+    /// through it in between libtiff's appends of base ones.
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> out_ = {
+        nullptr, std::fclose};
+
+    /// Tags of `tiff_` which affect encoding, so tiles are encoded apart
+    /// from it the same way libtiff would
+    struct TileFormat {
+        uint16_t compression = 0;
+        uint16_t photometric = 0;
+        uint16_t bits = 0;
+        uint16_t sample_format = 0;
+        uint16_t samples = 0;
+        uint32_t tile_size = 0;
+        int quality = 0;
+        int jpeg_color_mode = JPEGCOLORMODE_RAW;
+        uint16_t predictor = PREDICTOR_NONE;
+    };
+
+    /// Level of pyramid, base one is first.
+    /// Reduced levels are built while base tiles arrive: each tile is
+    /// downscaled into quarter of its parent, complete parents are encoded
+    /// on thread pool and cascade further up. Encoded tiles go straight
+    /// to end of output, only their places are kept, and directories of
+    /// reduced levels are written at `close` to point at them.
+    struct Level {
+        size_t height = 0;
+        size_t width = 0;
+        size_t tiles_y = 0;
+        size_t tiles_x = 0;
+        /// Parents waiting for the rest of children, with count of received
+        std::map<size_t, std::pair<std::vector<uint8_t>, size_t>> pending = {};
+        /// Offset and size of each tile in output, missing ones are zeros
+        std::vector<std::pair<uint64_t, uint64_t>> tiles = {};
+    };
+    std::vector<Level> levels_ = {};
+    TileFormat format_ = {};
+    /// Base tiles already put, as repeated one would be counted twice
+    /// by its parent
+    std::vector<bool> written_ = {};
+
+    /// Tiles being encoded on thread pool as (level, pos, bytes), taken in
+    /// order of arrival, so base ones are written in order
+    std::deque<std::tuple<size_t, size_t, std::future<std::vector<uint8_t>>>>
+        queue_ = {};
+
+    /// Writes encoded tiles from the front of queue, base ones through
+    /// libtiff, reduced ones through `out_`. Waits for all of them if
+    /// `all`, else only while more than two per worker are queued.
+    void flush(bool all);
+
+    /// Closes `tiff_` after its base directory, then appends directories
+    /// of reduced levels and links them after base one
+    void write_levels(std::vector<double> spacing);
 
     void base_tags(TiffFile& level_tiff);
     void pyramid_tags(TiffFile& level_tiff, size_t height, size_t width);
-    void temp_pyramid_tags(TiffFile& level_tiff, size_t height, size_t width);
 
-    template <typename T>
-    void write_pyramid_level(
-        TiffFile& level_tiff, size_t level_height, size_t level_width,
-        size_t samples);
+    /// Splits image to levels until width is closest to 1024
+    void plan_levels(size_t height, size_t width);
+
+    /// Compresses single tile with `format_`, safe to call from any thread
+    std::vector<uint8_t> encode_tile(void const* data, size_t size) const;
 
+    /// Downscales tile at (iy, ix) of `level` into quarter of its parent
     template <typename T>
-    std::shared_ptr<T> downscale_tile(std::shared_ptr<T> tile, size_t tile_size, size_t samples);
+    void reduce_tile(size_t level, size_t iy, size_t ix, T const* tile);
 
+    /// Encodes complete tile at (iy, ix) of `level`, then reduces it further
     template <typename T>
-    void write_pyramid_to_disk();
+    void finish_tile(size_t level, size_t iy, size_t ix, std::vector<uint8_t> tile);
 
+    /// Completes parents left without some children, waits for encoding
+    /// and writes reduced levels after base one
     template <typename T>
-    void incorporate_pyramid();
+    void write_pyramid();
 
     /// Determine min/max of tile part
     template <typename T>
     void update_limits(std::vector<T> const& tile);
 
     template <typename T>
-    void put_impl(std::vector<T> const& tile, size_t pos);
+    void put_impl(std::vector<T> tile, size_t pos);
 
 public:
-    ImageWriter(const std::string& filename);
+    Writer(const std::string& filename);
 
     const std::string& filename() const { return filename_; }
 
     void size(size_t size_y, size_t size_x);
 
     template <typename T>
-    void append(std::vector<T> const& data);
+    void append(std::vector<T> data);
 
     template<typename T>
-    void put(std::vector<T> const& data, size_t y, size_t x);
+    void put(std::vector<T> data, size_t y, size_t x);
 
     /// Will close the base image and finish writing the image pyramid and
     /// optionally the thumbnail image.
@@ -117,111 +186,132 @@ public:
 };
 
 template <typename T>
-void ImageWriter::update_limits(std::vector<T> const& tile) {
+void Writer::update_limits(std::vector<T> const& tile) {
     for (size_t i = 0; i < tile_size_ * tile_size_ * cdepth_; i += cdepth_)
         for (size_t j = 0; j < cdepth_; ++j) {
-            double val = data[i + j];
+            double val = tile[i + j];
             max_vals_[j] = std::max(max_vals_[j], val);
             min_vals_[j] = std::min(min_vals_[j], val);
         }
 }
 
 template <typename T>
-void ImageWriter::append(std::vector<T> const& data) {
-    put_impl(data, pos_++);
+void Writer::append(std::vector<T> data) {
+    put_impl(std::move(data), pos_++);
 }
 
 template <typename T>
-void ImageWriter::put(std::vector<T> const& data, size_t y, size_t x) {
-    put_impl(data, position(y, x));
+void Writer::put(std::vector<T> data, size_t y, size_t x) {
+    put_impl(std::move(data), position(y, x));
 }
 
 template <typename T>
-void ImageWriter::put_impl(std::vector<T> const& tile, size_t pos) {
+void Writer::put_impl(std::vector<T> tile, size_t pos) {
+    if (pos >= written_.size())
+        throw std::out_of_range{"Tile is out of image"};
+    if (written_[pos])
+        throw std::runtime_error{"Tile is already written"};
+    written_[pos] = true;
+
     size_t pixels = tile_size_ * tile_size_ * cdepth_;
 
     update_limits(tile);
+    auto const& base = levels_.front();
+    reduce_tile(0, pos / base.tiles_x, pos % base.tiles_x, tile.data());
 
     size_t size = pixels * gs::bytes(dtype_);
-    if (codec_ == Codec::JPEG2000) {
-        auto compressed = jp2k::encode(
-            reinterpret_cast<char*>(data), size, tile_size_, quality_, cdepth_,
-            dtype_, ctype_);
-        tiff_.write_raw(pos, compressed);
-        // TIFFWriteRawTile(tiff_, static_cast<uint32_t>(pos), data, size);
-    } else
-        tiff_.write_encoded(pos, tile);
-        // TIFFWriteEncodedTile(
-        //     tiff_, static_cast<uint32_t>(pos), data, size);
+    queue_.emplace_back(
+        0,
+        pos,
+        ts::thread_pool().submit([this, tile = std::move(tile), size] {
+            return encode_tile(tile.data(), size);
+        }));
+    flush(false);
 }
 
 template <typename T>
-void ImageWriter::write_pyramid_level(
-    TiffFile& level_tiff,
-    size_t level_height, size_t level_width, size_t samples
-) {
+void Writer::reduce_tile(size_t level, size_t iy, size_t ix, T const* tile) {
+    if (level + 1 >= levels_.size())
+        return;
+    auto const& child = levels_[level];
+    auto& parent = levels_[level + 1];
+    size_t py = iy / 2, px = ix / 2;
+    /// Last row or column of odd-sized level is cut off by halving
+    if (py >= parent.tiles_y || px >= parent.tiles_x)
+        return;
+
+    size_t samples = cdepth_;
     size_t pixels = tile_size_ * tile_size_ * samples;
-    if (codec_ == Codec::JPEG2000)
-        for (size_t pos = 0; pos < level_tiff.tiles(); ++i)
-            tiff_.write_raw(pos, level_tiff.read_encoded<T>(pos, pixels));
-    else
-        for (size_t pos = 0; pos < level_tiff.tiles(); ++pos)
-            tiff_.write_encoded(pos, level_tiff.read_encoded<T>(pos, pixels));
-}
-
-template <typename T>
-std::shared_ptr<T> ImageWriter::downscale_tile(
-    std::shared_ptr<T> tile, size_t tile_size, size_t samples
-) {
-    size_t out_size = tile_size / 2;
-    size_t pixels = out_size * out_size * samples;
-    auto out = gs::tiff_new<T>(out_size * out_size * samples);
-
-    size_t row = tile_size * samples;
-    size_t col = samples;
-
-    auto out_tile = out.get();
-    for (size_t y = 0; y < out_size; ++y)
-        for (size_t x = 0; x < out_size; ++x)
+    size_t pos = py * parent.tiles_x + px;
+    auto& [buf, received] = parent.pending[pos];
+    if (buf.empty())
+        buf.resize(pixels * sizeof(T));
+
+    size_t half = tile_size_ / 2;
+    size_t row = tile_size_ * samples;
+    auto out = reinterpret_cast<T*>(buf.data())
+        + ((iy % 2) * half * tile_size_ + (ix % 2) * half) * samples;
+    for (size_t y = 0; y < half; ++y)
+        for (size_t x = 0; x < half; ++x)
             for (size_t s = 0; s < samples; ++s) {
-                size_t index = (2 * y * tile_size * samples) + (2 * x * samples) + s;
-                size_t out_index = (y * out_size * samples) + (x * samples) + s;
+                size_t index = 2 * y * row + 2 * x * samples + s;
+                auto& value = out[y * row + x * samples + s];
                 if (interpolation_ == Interpolation::Linear)
-                    out_tile[out_index] = static_cast<T>(
+                    value = static_cast<T>(
                         tile[index] / 4. +
+                        tile[index + samples] / 4. +
                         tile[index + row] / 4. +
-                        tile[index + col] / 4. +
-                        tile[index + row + col] / 4.
+                        tile[index + row + samples] / 4.
                     );
                 else
-                    out_tile[out_index] = tile[index];
+                    value = tile[index];
             }
-    return out;
+
+    size_t expected = std::min<size_t>(2, child.tiles_y - 2 * py)
+                      * std::min<size_t>(2, child.tiles_x - 2 * px);
+    if (++received < expected)
+        return;
+    auto done = std::move(buf);
+    parent.pending.erase(pos);
+    finish_tile<T>(level + 1, py, px, std::move(done));
 }
 
 template <typename T>
-void ImageWriter::incorporate_pyramid() {
-    for (const auto& level_file: level_files_) {
-        auto level = gs::tiff_open(level_file, "rm");
-
-        float spacing_y = 0;
-        float spacing_x = 0;
-        if ((TIFFGetField(level.get(), TIFFTAG_YRESOLUTION, &spacing_y) == 1)
-            && (TIFFGetField(level.get(), TIFFTAG_XRESOLUTION, &spacing_x) == 1))
-            this->spacing({10000. / spacing_y, 10000. / spacing_x});
-
-        size_t level_h = tiff_.field(TIFFTAG_IMAGELENGTH);
-        size_t level_w = tiff_.field(TIFFTAG_IMAGEWIDTH);
-
-        pyramid_tags(tiff_, level_h, level_w);
-
-        tiff_.field(TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
-        size_t samples = tiff_.field(TIFFTAG_SAMPLESPERPIXEL);
+void Writer::finish_tile(
+    size_t level, size_t iy, size_t ix, std::vector<uint8_t> tile
+) {
+    auto data = std::make_shared<std::vector<uint8_t> const>(std::move(tile));
+    auto pos = iy * levels_[level].tiles_x + ix;
+    queue_.emplace_back(level, pos, ts::thread_pool().submit([this, data] {
+        return encode_tile(data->data(), data->size());
+    }));
+    reduce_tile(level, iy, ix, reinterpret_cast<T const*>(data->data()));
+}
 
-        write_pyramid_level<T>(level, level_h, level_w, samples);
-        tiff_.write_directory();
-    }
-    return 0;
+template <typename T>
+void Writer::write_pyramid() {
+    /// Parents of tiles never written are completed with zeros
+    for (size_t level = 1; level < levels_.size(); ++level)
+        while (!levels_[level].pending.empty()) {
+            auto it = levels_[level].pending.begin();
+            auto pos = it->first;
+            auto tile = std::move(it->second.first);
+            levels_[level].pending.erase(it);
+            finish_tile<T>(
+                level,
+                pos / levels_[level].tiles_x,
+                pos % levels_[level].tiles_x,
+                std::move(tile));
+        }
+    flush(true);
+
+    std::vector<double> spacing{
+        10000. / tiff_.template field<float>(TIFFTAG_YRESOLUTION),
+        10000. / tiff_.template field<float>(TIFFTAG_XRESOLUTION),
+    };
+    tiff_.write_directory();
+    write_levels(std::move(spacing));
+    levels_.clear();
 }
 
 } // namespace gs
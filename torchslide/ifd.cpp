@@ -0,0 +1,141 @@
+#include <set>
+#include <stdexcept>
+
+#include "ifd.h"
+
+namespace ts::ifd {
+
+/// Byte size of value of each TIFF type, 0 for unknown ones
+size_t _type_size(uint16_t type) noexcept {
+    switch (type) {
+    case 1: // BYTE
+    case 2: // ASCII
+    case 6: // SBYTE
+    case 7: // UNDEFINED
+        return 1;
+    case 3: // SHORT
+    case 8: // SSHORT
+        return 2;
+    case 4:  // LONG
+    case 9:  // SLONG
+    case 11: // FLOAT
+    case 13: // IFD
+        return 4;
+    case 5:  // RATIONAL
+    case 10: // SRATIONAL
+    case 12: // DOUBLE
+    case 16: // LONG8
+    case 17: // SLONG8
+    case 18: // IFD8
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+std::span<uint8_t const>
+_at(std::span<uint8_t const> file, uint64_t offset, uint64_t size) {
+    if (offset > file.size() || size > file.size() - offset)
+        throw std::runtime_error{"Tiff is truncated"};
+    return file.subspan(static_cast<size_t>(offset), static_cast<size_t>(size));
+}
+
+uint64_t _read(
+    std::span<uint8_t const> file,
+    uint64_t offset,
+    size_t size,
+    bool big_endian) {
+    auto bytes = _at(file, offset, size);
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i)
+        value |= uint64_t{bytes[big_endian ? size - 1 - i : i]} << (8 * i);
+    return value;
+}
+
+uint64_t Ifd::_value_at(Entry const& e, uint64_t index) const {
+    auto size = _type_size(e.type);
+    if (e.type == 5 || e.type == 10 || e.type == 11 || e.type == 12 || !size)
+        throw std::runtime_error{"Tiff tag is not integral"};
+    return _read(_file, e.offset + index * size, size, _big_endian);
+}
+
+std::optional<uint64_t> Ifd::get(uint16_t tag) const {
+    auto it = entries.find(tag);
+    if (it == entries.end() || !it->second.count)
+        return {};
+    return _value_at(it->second, 0);
+}
+
+std::vector<uint64_t> Ifd::get_array(uint16_t tag) const {
+    auto it = entries.find(tag);
+    if (it == entries.end())
+        return {};
+    auto const& e = it->second;
+    _at(_file, e.offset, e.count * _type_size(e.type));
+
+    std::vector<uint64_t> values(static_cast<size_t>(e.count));
+    for (uint64_t i = 0; i < e.count; ++i)
+        values[i] = _value_at(e, i);
+    return values;
+}
+
+std::optional<double> Ifd::get_rational(uint16_t tag) const {
+    auto it = entries.find(tag);
+    if (it == entries.end() || it->second.type != 5 || !it->second.count)
+        return {};
+    auto num = _read(_file, it->second.offset, 4, _big_endian);
+    auto den = _read(_file, it->second.offset + 4, 4, _big_endian);
+    return den ? static_cast<double>(num) / static_cast<double>(den) : 0.0;
+}
+
+std::span<uint8_t const> Ifd::get_bytes(uint16_t tag) const {
+    auto it = entries.find(tag);
+    if (it == entries.end() || _type_size(it->second.type) != 1)
+        return {};
+    return _at(_file, it->second.offset, it->second.count);
+}
+
+std::vector<Ifd> read_chain(std::span<uint8_t const> file) {
+    auto order = _read(file, 0, 2, false);
+    if (order != 0x4949 && order != 0x4d4d)
+        throw std::runtime_error{"Not a TIFF"};
+    bool const big_endian = (order == 0x4d4d);
+    auto read = [&](uint64_t offset, size_t size) {
+        return _read(file, offset, size, big_endian);
+    };
+
+    /// Classic TIFF has 32-bit offsets and 12-byte entries,
+    /// BigTIFF - 64-bit ones and 20-byte entries
+    auto version = read(2, 2);
+    if (version != 42 && version != 43)
+        throw std::runtime_error{"Not a TIFF"};
+    bool const bigtiff = (version == 43);
+    size_t const word = bigtiff ? 8 : 4;
+    size_t const count_size = bigtiff ? 8 : 2;
+    size_t const entry_size = bigtiff ? 20 : 12;
+
+    std::vector<Ifd> chain;
+    std::set<uint64_t> seen;
+    for (auto pos = read(bigtiff ? 8 : 4, word); pos;) {
+        if (!seen.insert(pos).second)
+            throw std::runtime_error{"Tiff has looped IFD chain"};
+
+        auto count = read(pos, count_size);
+        auto& ifd = chain.emplace_back(file, big_endian);
+        for (uint64_t i = 0; i < count; ++i) {
+            auto at = pos + count_size + i * entry_size;
+            Entry e{
+                static_cast<uint16_t>(read(at + 2, 2)),
+                read(at + 4, word),
+                at + 4 + word};
+            /// value which doesn't fit into entry is stored elsewhere
+            if (e.count * _type_size(e.type) > word)
+                e.offset = read(at + 4 + word, word);
+            ifd.entries[static_cast<uint16_t>(read(at, 2))] = e;
+        }
+        pos = read(pos + count_size + count * entry_size, word);
+    }
+    return chain;
+}
+
+} // namespace ts::ifd
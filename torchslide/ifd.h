@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace ts::ifd {
+
+/// IFD entry: value type, count and where its bytes are in file
+struct Entry {
+    uint16_t type = 0;
+    uint64_t count = 0;
+    uint64_t offset = 0;
+};
+
+/// Image file directory of TIFF or BigTIFF, parsed straight from file
+/// bytes without libtiff. Only entries are read up front, values are
+/// decoded on access.
+struct Ifd {
+    Ifd(std::span<uint8_t const> file, bool big_endian) noexcept
+      : _file{file}
+      , _big_endian{big_endian} { }
+
+    std::map<uint16_t, Entry> entries = {};
+
+    bool has(uint16_t tag) const noexcept { return entries.count(tag); }
+    bool big_endian() const noexcept { return _big_endian; }
+
+    /// First value of integral tag
+    std::optional<uint64_t> get(uint16_t tag) const;
+
+    /// All values of integral tag, i.e. tile offsets
+    std::vector<uint64_t> get_array(uint16_t tag) const;
+
+    /// Value of RATIONAL tag
+    std::optional<double> get_rational(uint16_t tag) const;
+
+    /// Raw bytes of ASCII or UNDEFINED tag, i.e. JPEGTables
+    std::span<uint8_t const> get_bytes(uint16_t tag) const;
+
+private:
+    std::span<uint8_t const> _file;
+    bool _big_endian;
+
+    uint64_t _value_at(Entry const& e, uint64_t index) const;
+};
+
+/// Walks IFD chain from file header.
+/// Throws `std::runtime_error` on malformed or truncated file.
+std::vector<Ifd> read_chain(std::span<uint8_t const> file);
+
+} // namespace ts::ifd
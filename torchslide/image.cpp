@@ -2,7 +2,11 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
+#include "cache.h"
+#include "core/thread_pool.h"
+#include "dispatch.h"
 #include "image.h"
+#include "sidecar.h"
 
 #ifndef VERSION_INFO
 #define VERSION_INFO "dev"
@@ -11,6 +15,16 @@
 namespace py = pybind11;
 using namespace ts;
 
+LevelInfo LevelInfo::reduced(uint8_t reduce) const noexcept {
+    auto const factor = Size{1} << reduce;
+    return {
+        {ceil(shape[0], factor) / factor,
+         ceil(shape[1], factor) / factor,
+         shape[2]},
+        {tile_shape[0] / factor, tile_shape[1] / factor, tile_shape[2]},
+        static_cast<uint8_t>(reductions - reduce)};
+}
+
 Size ImageInfo::get_scale(LevelInfo const& info) const noexcept {
     return static_cast<Size>(
         std::round(static_cast<double>(this->levels.at(0).shape.front()) /
@@ -33,43 +47,721 @@ std::pair<Level, LevelInfo> ImageInfo::get_level(Size scale) const noexcept {
     return *it;
 }
 
+std::tuple<Level, uint8_t, Size>
+ImageInfo::get_source(Size scale) const noexcept {
+    auto best = std::tuple{levels.begin()->first, uint8_t{0}, Size{1}};
+    for (auto const& [level, info] : levels) {
+        auto level_scale = get_scale(info);
+        for (uint8_t r = 0; r <= info.reductions; ++r) {
+            auto [_, best_r, best_scale] = best;
+            auto s = level_scale << r;
+            if (s <= scale
+                && (s > best_scale || (s == best_scale && r < best_r)))
+                best = {level, r, s};
+        }
+    }
+    return best;
+}
+
 Image::~Image() noexcept {}
 
-py::buffer
-get_item(Image const& self, std::tuple<py::slice, py::slice> slices) {
+TissueMask Image::tile_occupancy(Level level, double) const {
+    auto const& [shape, tile_shape, _] = this->levels.at(level);
+    auto const h = ceil(shape[0], tile_shape[0]) / tile_shape[0];
+    auto const w = ceil(shape[1], tile_shape[1]) / tile_shape[1];
+    return {h, w, std::vector<uint8_t>(static_cast<size_t>(h * w), 1)};
+}
+
+TissueMask const& Image::tissue() const {
+    /// Other threads may wait for mask here, so GIL is released first
+    py::gil_scoped_release no_gil;
+    NoFork no_fork;
+    std::call_once(this->_tissue_once, [this] {
+        this->_tissue = this->find_tissue_any();
+    });
+    return this->_tissue;
+}
+
+std::unique_ptr<Image>
+open_image(std::string const& path, std::span<uint8_t const> state = {}) {
+    std::unique_ptr<Image> image;
+    {
+        NoFork no_fork;
+        image = Image::make(path, state);
+    }
+    image->path = path;
+    return image;
+}
+
+/// Image is pickled as its path and parsed state, so worker processes
+/// skip parsing. State is ignored if file was changed in between.
+py::tuple get_state(Image const& self) {
+    std::vector<uint8_t> state;
+    {
+        py::gil_scoped_release no_gil;
+        NoFork no_fork;
+        state = self.state();
+    }
+    return py::make_tuple(
+        self.path.string(),
+        py::bytes(reinterpret_cast<char const*>(state.data()), state.size()));
+}
+
+std::unique_ptr<Image> set_state(py::tuple const& t) {
+    if (t.size() != 2)
+        throw std::runtime_error{"Invalid state"};
+    auto path = t[0].cast<std::string>();
+    auto state = t[1].cast<std::string>();
+
+    py::gil_scoped_release no_gil;
+    return open_image(
+        path,
+        {reinterpret_cast<uint8_t const*>(state.data()), state.size()});
+}
+
+/// Box of source level for `slices`, and area filter if no level
+/// is of their steps
+std::pair<Box, std::optional<Area>>
+to_region(Image const& self, std::tuple<py::slice, py::slice> const& slices) {
     auto const& [ys, xs] = slices;
+    auto const& shape = self.levels.at(0).shape;
 
-    auto y_min = ys.attr("start");
-    auto x_min = xs.attr("start");
-    auto y_max = ys.attr("stop");
-    auto x_max = xs.attr("stop");
-    auto y_step_ = ys.attr("step");
-    auto x_step_ = xs.attr("step");
+    auto get = [](py::slice const& s, char const* name, Size default_) {
+        auto value = s.attr(name);
+        return (!value.is_none()) ? value.cast<Size>() : default_;
+    };
+    auto const y_min = get(ys, "start", 0);
+    auto const x_min = get(xs, "start", 0);
+    auto const y_max = get(ys, "stop", shape[0]);
+    auto const x_max = get(xs, "stop", shape[1]);
+    auto const y_step = get(ys, "step", 1);
+    auto const x_step = get(xs, "step", 1);
+    if (y_step < 1 || x_step < 1)
+        throw std::runtime_error{"Steps must be positive"};
+
+    /// Same as length of Python's slice, but area beyond image is kept
+    auto const h = ceil(std::max(y_max - y_min, Size{}), y_step) / y_step;
+    auto const w = ceil(std::max(x_max - x_min, Size{}), x_step) / x_step;
 
-    size_t y_step = (!y_step_.is_none()) ? y_step_.cast<Size>() : 1;
-    size_t x_step = (!x_step_.is_none()) ? x_step_.cast<Size>() : 1;
-    if (y_step != x_step)
-        throw std::runtime_error{"Y and X steps must be equal"};
+    auto const [level, reduce, scale]
+        = self.get_source(std::min(y_step, x_step));
 
-    auto const& [level, info] = self.get_level(y_step);
-    auto scale = self.get_scale(info);
+    if (y_step == scale && x_step == scale) {
+        auto const y = floor(y_min, scale) / scale;
+        auto const x = floor(x_min, scale) / scale;
+        Box box{{y, x}, {y + h, x + w}, level, reduce};
+        return {box, std::nullopt};
+    }
 
+    /// No level of that scale, so downsample from finer one.
+    /// Footprint is rounded outwards, negative starts too.
     Box box{
-        {(!y_min.is_none() ? y_min.cast<Size>() / scale : 0),
-         (!x_min.is_none() ? x_min.cast<Size>() / scale : 0)},
-        {(!y_max.is_none() ? y_max.cast<Size>() / scale : info.shape[0]),
-         (!x_max.is_none() ? x_max.cast<Size>() / scale : info.shape[1])},
-        level
-    };
+        {floor(y_min, scale) / scale, floor(x_min, scale) / scale},
+        {ceil(y_min + h * y_step, scale) / scale,
+         ceil(x_min + w * x_step, scale) / scale},
+        level,
+        reduce};
+    Area area{
+        {y_min - box.min_[0] * scale, x_min - box.min_[1] * scale},
+        {y_step, x_step},
+        scale,
+        {h, w}};
+    return {box, area};
+}
+
+py::buffer
+get_item(Image const& self, std::tuple<py::slice, py::slice> slices) {
+    auto const [box, area] = to_region(self, slices);
+    if (area)
+        return self.read_area_any(box, *area);
     return self.read_any(box);
 }
 
+std::pair<Level, Size> level_at(Image const& self, size_t level) {
+    if (level >= self.levels.size())
+        throw py::index_error{"Level is out of range"};
+    auto const& [key, info] = *std::next(self.levels.begin(), level);
+    return {key, self.get_scale(info)};
+}
+
+void read_into(
+    Image const& self, py::buffer out, Size y, Size x, size_t level) {
+    auto const [key, scale] = level_at(self, level);
+
+    auto buf = out.request(true);
+    if (buf.ndim != 3)
+        throw std::runtime_error{"Buffer must be of (H, W, C) shape"};
+
+    /// Floored as in `to_region`, so both agree on negative coordinates
+    auto const y_ = floor(y, scale) / scale;
+    auto const x_ = floor(x, scale) / scale;
+    Box box{{y_, x_}, {y_ + buf.shape[0], x_ + buf.shape[1]}, key};
+    self.read_into_any(box, buf);
+}
+
+std::vector<Box> to_boxes(
+    Image const& self,
+    std::vector<std::array<Size, 4>> const& boxes,
+    size_t level) {
+    auto const [key, scale] = level_at(self, level);
+
+    /// Start is floored as in `to_region`, and shape comes from level-0
+    /// size alone, so boxes of equal size are equal at any offset
+    std::vector<Box> boxes_;
+    for (auto const& [y_min, x_min, y_max, x_max] : boxes) {
+        auto const y = floor(y_min, scale) / scale;
+        auto const x = floor(x_min, scale) / scale;
+        boxes_.push_back({
+            {y, x},
+            {y + std::max(y_max - y_min, Size{}) / scale,
+             x + std::max(x_max - x_min, Size{}) / scale},
+            key
+        });
+        if (boxes_.back().shape(0) != boxes_.front().shape(0)
+            || boxes_.back().shape(1) != boxes_.front().shape(1))
+            throw std::runtime_error{"Boxes must be of equal shape"};
+    }
+    return boxes_;
+}
+
+py::buffer read_batch(
+    Image const& self,
+    std::vector<std::array<Size, 4>> const& boxes,
+    size_t level,
+    bool tissue) {
+    auto boxes_ = to_boxes(self, boxes, level);
+    if (!tissue || boxes_.empty())
+        return self.read_batch_any(boxes_);
+
+    /// Only boxes with foreground are read, others are left zeroed
+    auto const& mask = self.tissue();
+    auto const& [h, w, _] = self.levels.at(0).shape;
+    std::vector<size_t> indices;
+    std::vector<Box> selected;
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        auto const& [y_min, x_min, y_max, x_max] = boxes[i];
+        if (mask.any(y_min, x_min, y_max, x_max, h, w)) {
+            indices.push_back(i);
+            selected.push_back(boxes_[i]);
+        }
+    }
+    if (selected.size() == boxes_.size())
+        return self.read_batch_any(boxes_);
+
+    py::array out{
+        std::visit(
+            [](auto v) { return py::dtype::of<decltype(v)>(); }, self.dtype),
+        std::vector<py::ssize_t>{
+            static_cast<py::ssize_t>(boxes_.size()),
+            boxes_.front().shape(0),
+            boxes_.front().shape(1),
+            self.samples}};
+    auto const dst = static_cast<uint8_t*>(out.mutable_data());
+    auto const item = static_cast<size_t>(out.nbytes()) / boxes_.size();
+    py::buffer_info part;
+    if (!selected.empty())
+        part = self.read_batch_any(selected).request();
+
+    py::gil_scoped_release no_gil;
+    std::memset(dst, 0, item * boxes_.size());
+    for (size_t i = 0; i < indices.size(); ++i)
+        std::memcpy(
+            dst + indices[i] * item,
+            static_cast<uint8_t const*>(part.ptr) + i * item,
+            item);
+    return out;
+}
+
+/// Walks level in storage-tile order with patches of `size` every
+/// `stride` pixels, yielding batches of them with their level 0 (y, x)
+/// coordinates. Patch belongs to tile holding its top-left corner.
+/// Decoded pixels are kept in window of current tile and parts of its
+/// neighbours which its patches reach, sliding right along tile row,
+/// so it's small whatever width of level is. Tiles below current row
+/// are read again for the next one, from tile cache if it holds them.
+struct TileIterator {
+    using Mask
+        = py::array_t<bool, py::array::c_style | py::array::forcecast>;
+
+    TileIterator(
+        py::object image,
+        size_t level,
+        Size size,
+        Size stride,
+        std::optional<Mask> const& mask,
+        bool tissue,
+        Size batch);
+
+    py::tuple next();
+
+private:
+    /// Keeps image alive while iterator exists
+    py::object const _image;
+    Image const* _self;
+    Level _level;
+    Size _scale;
+    Shape _shape;
+    Size _tile_h;
+    Size _tile_w;
+    Size const _size;
+    Size const _stride;
+    Size const _batch;
+    py::dtype _dtype;
+    size_t _pixel_bytes;
+
+    /// Patches of level, and tiles of it
+    Size _rows;
+    Size _cols;
+    Size _tiles_y;
+    Size _tiles_x;
+
+    /// Current tile, range of its patches and current one of them
+    Size _ty = 0;
+    Size _tx = 0;
+    Size _r0 = 0, _r1 = 0, _r = 0;
+    Size _c0 = 0, _c1 = 0, _c = 0;
+
+    /// Patch is yielded only if user's mask is set at its center,
+    /// and if any tissue is under it
+    TissueMask _mask;
+    TissueMask _tissue;
+
+    /// Ring of tile rows which patches of current tile row reach, each
+    /// of `_band_w` pixels. Row is read left to right as patches need it,
+    /// up to `_done` column, and its slot is reused only once it's above
+    /// current tile row, so each tile is read exactly once.
+    std::vector<std::vector<uint8_t>> _band;
+    std::vector<Size> _band_ty;
+    std::vector<Size> _done;
+    Size _band_w;
+
+    /// Finds patches of current tile, false if there are no more tiles
+    bool _enter_tile();
+
+    bool _selected(Size y, Size x) const noexcept;
+
+    /// Makes band hold rows [y0, y1) up to column x1, reading only
+    /// tiles not read yet
+    void _cover(Size y0, Size y1, Size x1);
+};
+
+TileIterator::TileIterator(
+    py::object image,
+    size_t level,
+    Size size,
+    Size stride,
+    std::optional<Mask> const& mask,
+    bool tissue,
+    Size batch)
+  : _image{std::move(image)}
+  , _self{&_image.cast<Image const&>()}
+  , _size{size}
+  , _stride{stride}
+  , _batch{batch} {
+    if (size < 1 || stride < 1 || batch < 1)
+        throw std::runtime_error{"Size, stride and batch must be positive"};
+
+    auto const [key, scale] = level_at(*this->_self, level);
+    auto const& info = this->_self->levels.at(key);
+    this->_level = key;
+    this->_scale = scale;
+    this->_shape = info.shape;
+    this->_tile_h = std::max(info.tile_shape[0], Size{1});
+    this->_tile_w = std::max(info.tile_shape[1], Size{1});
+    this->_rows = ceil(this->_shape[0], stride) / stride;
+    this->_cols = ceil(this->_shape[1], stride) / stride;
+    this->_tiles_y = ceil(this->_shape[0], this->_tile_h) / this->_tile_h;
+    this->_tiles_x = ceil(this->_shape[1], this->_tile_w) / this->_tile_w;
+
+    this->_dtype = std::visit(
+        [](auto v) { return py::dtype::of<decltype(v)>(); },
+        this->_self->dtype);
+    this->_pixel_bytes = static_cast<size_t>(
+        this->_dtype.itemsize() * this->_shape[2]);
+
+    if (mask) {
+        if (mask->ndim() != 2)
+            throw std::runtime_error{"Mask must be 2D"};
+        this->_mask.h = mask->shape()[0];
+        this->_mask.w = mask->shape()[1];
+        auto ptr = reinterpret_cast<uint8_t const*>(mask->data());
+        this->_mask.data.assign(ptr, ptr + mask->size());
+    }
+    if (tissue)
+        this->_tissue = this->_self->tissue();
+
+    /// Patch starting in tile row reaches this many rows below it, and
+    /// last patch of level reaches beyond it, which reader pads
+    auto const slots = 1 + (this->_tile_h + size - 2) / this->_tile_h;
+    this->_band_w = ceil((this->_cols - 1) * stride + size, this->_tile_w);
+    this->_band.resize(static_cast<size_t>(slots));
+    for (auto& row : this->_band)
+        row.resize(
+            static_cast<size_t>(this->_tile_h * this->_band_w)
+            * this->_pixel_bytes);
+    this->_band_ty.assign(this->_band.size(), -1);
+    this->_done.assign(this->_band.size(), 0);
+    this->_enter_tile();
+}
+
+bool TileIterator::_enter_tile() {
+    auto const s = this->_stride;
+    for (; this->_ty < this->_tiles_y; ++this->_ty, this->_tx = 0) {
+        auto const y = this->_ty * this->_tile_h;
+        this->_r0 = ceil(y, s) / s;
+        this->_r1 = std::min(this->_rows, ceil(y + this->_tile_h, s) / s);
+        for (; this->_tx < this->_tiles_x; ++this->_tx) {
+            auto const x = this->_tx * this->_tile_w;
+            this->_c0 = ceil(x, s) / s;
+            this->_c1 = std::min(this->_cols, ceil(x + this->_tile_w, s) / s);
+            if (this->_r0 < this->_r1 && this->_c0 < this->_c1) {
+                this->_r = this->_r0;
+                this->_c = this->_c0;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool TileIterator::_selected(Size y, Size x) const noexcept {
+    auto const& [h, w, _] = this->_self->levels.at(0).shape;
+    auto const scale = this->_scale;
+    if (!this->_mask.empty()
+        && !this->_mask.at(
+            (y + this->_size / 2) * scale,
+            (x + this->_size / 2) * scale,
+            h,
+            w))
+        return false;
+    return this->_tissue.empty()
+           || this->_tissue.any(
+               y * scale,
+               x * scale,
+               (y + this->_size) * scale,
+               (x + this->_size) * scale,
+               h,
+               w);
+}
+
+void TileIterator::_cover(Size y0, Size y1, Size x1) {
+    auto const th = this->_tile_h;
+    auto const slots = static_cast<Size>(this->_band.size());
+    x1 = ceil(x1, this->_tile_w);
+
+    for (auto ty = y0 / th; ty < ceil(y1, th) / th; ++ty) {
+        auto const i = static_cast<size_t>(ty % slots);
+        if (this->_band_ty[i] != ty) {
+            this->_band_ty[i] = ty;
+            this->_done[i] = 0;
+        }
+        auto& done = this->_done[i];
+        if (done >= x1)
+            continue;
+
+        py::array part{
+            this->_dtype,
+            std::vector<py::ssize_t>{th, x1 - done, this->_shape[2]}};
+        auto buf = part.request(true);
+        Box box{{ty * th, done}, {(ty + 1) * th, x1}, this->_level};
+        this->_self->read_into_any(box, buf);
+
+        auto const line = (x1 - done) * this->_pixel_bytes;
+        auto const row_bytes = this->_band_w * this->_pixel_bytes;
+        auto const src = static_cast<uint8_t const*>(buf.ptr);
+        auto const dst = this->_band[i].data() + done * this->_pixel_bytes;
+        for (Size r = 0; r < th; ++r)
+            std::memcpy(dst + r * row_bytes, src + r * line, line);
+        done = x1;
+    }
+}
+
+py::tuple TileIterator::next() {
+    auto const patch_bytes = this->_pixel_bytes * this->_size * this->_size;
+    auto const row_bytes = this->_pixel_bytes * this->_band_w;
+    auto const th = this->_tile_h;
+    auto const slots = static_cast<Size>(this->_band.size());
+
+    py::array out{
+        this->_dtype,
+        std::vector<py::ssize_t>{
+            this->_batch, this->_size, this->_size, this->_shape[2]}};
+    py::array_t<Size> coords{std::vector<py::ssize_t>{this->_batch, 2}};
+    auto dst = static_cast<uint8_t*>(out.mutable_data());
+    auto pos = coords.mutable_data();
+
+    Size n = 0;
+    while (n < this->_batch && this->_ty < this->_tiles_y) {
+        auto const y = this->_r * this->_stride;
+        auto const x = this->_c * this->_stride;
+        if (++this->_c == this->_c1) {
+            this->_c = this->_c0;
+            if (++this->_r == this->_r1) {
+                ++this->_tx;
+                this->_enter_tile();
+            }
+        }
+        if (!this->_selected(y, x))
+            continue;
+
+        this->_cover(y, y + this->_size, x + this->_size);
+        {
+            py::gil_scoped_release no_gil;
+            auto const line = this->_size * this->_pixel_bytes;
+            auto patch = dst + n * patch_bytes;
+            for (auto row = y; row < y + this->_size; ++row, patch += line) {
+                auto const& slot
+                    = this->_band[static_cast<size_t>(row / th % slots)];
+                std::memcpy(
+                    patch,
+                    slot.data() + (row % th) * row_bytes
+                        + x * this->_pixel_bytes,
+                    line);
+            }
+        }
+        pos[2 * n] = y * this->_scale;
+        pos[2 * n + 1] = x * this->_scale;
+        ++n;
+    }
+    if (!n)
+        throw py::stop_iteration{};
+    if (n == this->_batch)
+        return py::make_tuple(out, coords);
+    return py::make_tuple(
+        out[py::slice(0, n, 1)].cast<py::array>(),
+        coords[py::slice(0, n, 1)].cast<py::array>());
+}
+
+/// Futures of background reads. Decoding threads never take GIL: they
+/// hand results to single thread, which sets them with GIL held.
+/// At exit it finishes pending reads, so none outlives interpreter.
+struct Completions {
+    /// Makes Python result, called with GIL
+    using Finish = std::function<py::object()>;
+
+    /// Runs `fn` on decoding pool without GIL, returns
+    /// `concurrent.futures.Future` of its `Finish`. `keep` is held
+    /// until then, i.e. image `fn` reads. Cancelled future skips `fn`
+    /// if it isn't started yet. Called with GIL.
+    template <typename Fn>
+    py::object submit(py::object keep, Fn&& fn) {
+        auto future
+            = py::module::import("concurrent.futures").attr("Future")();
+        auto job = std::make_shared<_Job>();
+        /// Reads of parent never finish in child of fork
+        decltype(this->_futures) stale;
+        {
+            std::unique_lock lk{this->_mutex};
+            if (this->_stopping)
+                throw std::runtime_error{"Interpreter is shutting down"};
+            if (this->_epoch != fork_epoch()) {
+                stale.swap(this->_futures);
+                this->_epoch = fork_epoch();
+            }
+            if (!this->_thread.joinable())
+                this->_thread = std::thread{[this] { this->_loop(); }};
+            job->id = this->_next++;
+            ++this->_pending;
+        }
+        this->_futures.emplace(job->id, std::pair{future, std::move(keep)});
+        future.attr("add_done_callback")(
+            py::cpp_function([job](py::object const& f) {
+                if (f.attr("cancelled")().cast<bool>())
+                    job->cancelled = true;
+            }));
+
+        thread_pool().submit([this, job, fn = std::forward<Fn>(fn)] {
+            if (!job->cancelled)
+                try {
+                    job->finish = fn();
+                } catch (...) {
+                    job->error = std::current_exception();
+                }
+            {
+                std::unique_lock lk{this->_mutex};
+                this->_done.push_back(job);
+            }
+            this->_cv.notify_one();
+        });
+        return future;
+    }
+
+    /// Waits for pending reads and joins thread, called with GIL at exit
+    void stop() {
+        {
+            std::unique_lock lk{this->_mutex};
+            this->_stopping = true;
+        }
+        this->_cv.notify_all();
+        py::gil_scoped_release no_gil;
+        if (this->_thread.joinable())
+            this->_thread.join();
+    }
+
+    /// Never destroyed, as its thread is joined by `stop`
+    static Completions& get() {
+        static auto* const instance = [] {
+            auto ptr = new Completions;
+            at_fork({
+                [] { get()._mutex.lock(); },
+                [] { get()._mutex.unlock(); },
+                [] {
+                    auto& self = get();
+                    /// Thread and its waits exist only in parent
+                    new (&self._thread) std::thread;
+                    new (&self._cv) std::condition_variable;
+                    self._done.clear();
+                    self._pending = 0;
+                    self._mutex.unlock();
+                },
+            });
+            return ptr;
+        }();
+        return *instance;
+    }
+
+private:
+    /// Part of read touched by decoding threads, so no Python objects
+    struct _Job {
+        size_t id = 0;
+        std::atomic<bool> cancelled = false;
+        Finish finish = {};
+        std::exception_ptr error = {};
+    };
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::thread _thread;
+    std::vector<std::shared_ptr<_Job>> _done;
+    size_t _pending = 0;
+    size_t _next = 0;
+    size_t _epoch = fork_epoch();
+    bool _stopping = false;
+
+    /// Future and object kept alive for it, by job id. Touched with GIL.
+    std::map<size_t, std::pair<py::object, py::object>> _futures;
+
+    void _loop() {
+        for (;;) {
+            std::vector<std::shared_ptr<_Job>> done;
+            {
+                std::unique_lock lk{this->_mutex};
+                this->_cv.wait(lk, [this] {
+                    return !this->_done.empty()
+                           || (this->_stopping && !this->_pending);
+                });
+                if (this->_done.empty())
+                    return;
+                done.swap(this->_done);
+            }
+            {
+                py::gil_scoped_acquire with_gil;
+                for (auto const& job : done)
+                    this->_resolve(*job);
+            }
+            std::unique_lock lk{this->_mutex};
+            this->_pending -= done.size();
+        }
+    }
+
+    void _resolve(_Job& job) {
+        auto node = this->_futures.extract(job.id);
+        if (node.empty())
+            return;
+        auto& future = node.mapped().first;
+        if (!future.attr("set_running_or_notify_cancel")().cast<bool>())
+            return;
+        try {
+            if (job.error)
+                std::rethrow_exception(job.error);
+            future.attr("set_result")(job.finish());
+        } catch (py::error_already_set const& e) {
+            future.attr("set_exception")(e.value());
+        } catch (std::exception const& e) {
+            future.attr("set_exception")(
+                py::module::import("builtins")
+                    .attr("RuntimeError")(e.what()));
+        }
+        job.finish = {};
+    }
+};
+
+py::object read_async(
+    py::object self, std::tuple<py::slice, py::slice> slices) {
+    auto const image = &self.cast<Image const&>();
+    auto const [box, area] = to_region(*image, slices);
+    return Completions::get().submit(
+        std::move(self), [image, box, area]() -> Completions::Finish {
+            auto t = image->read_tensor_any(box, area);
+            return [t = std::move(t)]() mutable -> py::object {
+                return std::visit(
+                    [](auto& t) -> py::object {
+                        return as_buffer(std::move(t));
+                    },
+                    t);
+            };
+        });
+}
+
+py::object prefetch(
+    py::object self,
+    std::vector<std::array<Size, 4>> const& boxes,
+    size_t level) {
+    auto const image = &self.cast<Image const&>();
+    auto boxes_ = to_boxes(*image, boxes, level);
+    return Completions::get().submit(
+        std::move(self), [image, boxes_]() -> Completions::Finish {
+            image->prefetch_any(boxes_);
+            return [] { return py::none(); };
+        });
+}
+
 PYBIND11_MODULE(torchslide, m) {
     m.attr("__version__") = VERSION_INFO;
-    m.attr("__all__") = py::make_tuple("Image");
+    m.attr("__all__")
+        = py::make_tuple(
+            "Image", "cache_info", "set_cache_size", "set_index_dir");
+
+    /// Pending background reads are done before interpreter is gone
+    py::module::import("atexit").attr("register")(
+        py::cpp_function([] { Completions::get().stop(); }));
+
+    m.def(
+        "set_cache_size",
+        [](size_t size) { tile_cache().resize(size); },
+        py::arg("size"),
+        "Set byte budget of decoded tile cache, 0 disables it");
+    m.def(
+        "cache_info",
+        []() {
+            auto info = tile_cache().info();
+            py::dict d;
+            d["hits"] = info.hits;
+            d["misses"] = info.misses;
+            d["evictions"] = info.evictions;
+            d["size"] = info.size;
+            d["capacity"] = info.capacity;
+            return d;
+        },
+        "Statistics of decoded tile cache");
+    m.def(
+        "set_index_dir",
+        [](std::optional<std::string> const& path) {
+            sidecar::set_dir(path ? Path{*path} : Path{});
+        },
+        py::arg("path"),
+        "Keep indices of opened slides in `path` to reopen them without "
+        "parsing, None disables them");
+
+    py::class_<TileIterator>(m, "TileIterator")
+        .def("__iter__", [](py::object self) { return self; })
+        .def("__next__", &TileIterator::next);
 
     py::class_<Image>(m, "Image")
-        .def(py::init(&Image::make), py::arg("path"))
+        .def(
+            py::init([](std::string const& path) { return open_image(path); }),
+            py::arg("path"))
+        .def(py::pickle(&get_state, &set_state))
         .def_property_readonly(
             "dtype",
             [](Image const& self) {
@@ -87,7 +779,112 @@ PYBIND11_MODULE(torchslide, m) {
         .def_property_readonly(
             "spacing",
             [](Image const& self) { return self.spacing; },
-            "Pixel size")
+            "Pixel size in micrometers, zeros if unknown")
         .def_property_readonly("scales", &Image::scales, "Scales")
-        .def("__getitem__", &get_item, py::arg("slices"));
+        .def("__getitem__", &get_item, py::arg("slices"))
+        .def(
+            "read_into",
+            &read_into,
+            py::arg("out"),
+            py::arg("y"),
+            py::arg("x"),
+            py::arg("level") = 0,
+            "Read region of out's shape at (y, x) of level 0 coordinates "
+            "from level-th scale, writing it directly into out")
+        .def(
+            "read_batch",
+            &read_batch,
+            py::arg("boxes"),
+            py::arg("level") = 0,
+            py::arg("tissue") = false,
+            "Read equally-sized (y_min, x_min, y_max, x_max) boxes "
+            "of level 0 coordinates from level-th scale as (N, H, W, C) "
+            "array. With tissue, boxes without foreground are not decoded "
+            "and left zeroed")
+        .def(
+            "tile_occupancy",
+            [](Image const& self, size_t level, double ratio) {
+                if (ratio <= 1)
+                    throw std::runtime_error{"Ratio must be over 1"};
+                auto const [key, _] = level_at(self, level);
+                TissueMask mask;
+                {
+                    py::gil_scoped_release no_gil;
+                    NoFork no_fork;
+                    mask = self.tile_occupancy(key, ratio);
+                }
+                py::array_t<bool> out{
+                    std::vector<py::ssize_t>{mask.h, mask.w}};
+                std::copy(
+                    mask.data.begin(),
+                    mask.data.end(),
+                    reinterpret_cast<uint8_t*>(out.mutable_data()));
+                return out;
+            },
+            py::arg("level") = 0,
+            py::arg("ratio") = 64.,
+            "Which tiles of level-th scale hold data as (tiles_y, tiles_x) "
+            "bool array. Taken from tile sizes, so nothing is decoded. "
+            "Missing TIFF tiles and ones compressed over ratio times "
+            "(i.e. blank) are not occupied. Faint tissue compresses "
+            "well too, so lower ratio keeps more of it")
+        .def(
+            "tissue_mask",
+            [](Image const& self) {
+                auto const& mask = self.tissue();
+                py::array_t<bool> out{
+                    std::vector<py::ssize_t>{mask.h, mask.w}};
+                std::copy(
+                    mask.data.begin(),
+                    mask.data.end(),
+                    reinterpret_cast<uint8_t*>(out.mutable_data()));
+                return out;
+            },
+            "Foreground mask of image found on its smallest level, "
+            "as (h, w) bool array")
+        .def(
+            "tiles",
+            [](py::object self,
+               size_t level,
+               Size size,
+               std::optional<Size> stride,
+               std::optional<TileIterator::Mask> const& mask,
+               bool tissue,
+               Size batch) {
+                return TileIterator{
+                    std::move(self),
+                    level,
+                    size,
+                    stride.value_or(size),
+                    mask,
+                    tissue,
+                    batch};
+            },
+            py::arg("level") = 0,
+            py::arg("size") = 512,
+            py::arg("stride") = py::none(),
+            py::arg("mask") = py::none(),
+            py::arg("tissue") = false,
+            py::arg("batch") = 64,
+            "Iterate over whole level-th scale by (size, size) patches "
+            "every stride pixels, yielding (patches, coords) batches of "
+            "(N, size, size, C) and (N, 2) arrays in order of storage "
+            "tiles, reading each tile once. Holds decoded tiles of as many "
+            "tile rows as a patch spans, across the whole level. "
+            "Coordinates are of level 0. With 2D mask over whole "
+            "image, only patches with center at non-zero mask are yielded. "
+            "With tissue, patches without foreground under them are "
+            "skipped before decoding. Both filters apply if both given")
+        .def(
+            "read_async",
+            &read_async,
+            py::arg("slices"),
+            "Same as `image[slices]`, but returns `concurrent.futures.Future`")
+        .def(
+            "prefetch",
+            &prefetch,
+            py::arg("boxes"),
+            py::arg("level") = 0,
+            "Decode tiles of boxes into cache in background, "
+            "returns `concurrent.futures.Future`");
 }
@@ -1,12 +1,16 @@
 #pragma once
 
 #include <map>
+#include <mutex>
+#include <optional>
+#include <vector>
 
 #include <pybind11/pytypes.h>
 
 #include "core/box.h"
 #include "core/factory.h"
 #include "core/std.h"
+#include "tissue.h"
 
 namespace py = pybind11;
 namespace ts {
@@ -17,6 +21,11 @@ namespace ts {
 struct LevelInfo {
     Shape shape;
     Shape tile_shape;
+    /// How many times codec can halve level while decoding it,
+    /// i.e. via JPEG's DCT scaling
+    uint8_t reductions = 0;
+
+    LevelInfo reduced(uint8_t reduce) const noexcept;
 };
 
 using Spacing = std::array<float, 2>;
@@ -31,14 +40,49 @@ struct ImageInfo {
     std::vector<Size> scales() const noexcept;
 
     std::pair<Level, LevelInfo> get_level(Size scale) const noexcept;
+
+    /// Level of largest scale not exceeding `scale`, i.e. source to
+    /// downsample from. It can be reduced by codec, native levels win ties.
+    /// Returns level, number of halvings and resulting scale.
+    std::tuple<Level, uint8_t, Size> get_source(Size scale) const noexcept;
 };
 
 struct Image : ImageInfo, Factory<Image> {
     template <class... Ts>
     Image(Ts&&... args) : ImageInfo{std::forward<Ts>(args)...} {}
 
+    /// File image was opened from, so it can be reopened after pickling
+    Path path = {};
+
+    /// Parsed metadata worth passing with pickle, i.e. tile tables.
+    /// Empty if reopening file from scratch is just as fast.
+    virtual std::vector<uint8_t> state() const { return {}; }
+
+    /// Reads of area beyond image, or of tiles missing from file, give
+    /// background of image, as it's known to reader
     virtual py::buffer read_any(Box const& box) const = 0;
+    virtual py::buffer
+    read_area_any(Box const& box, Area const& area) const = 0;
+    virtual void read_into_any(Box const& box, py::buffer_info& out) const = 0;
+    virtual py::buffer read_batch_any(std::vector<Box> const& boxes) const = 0;
+    virtual void prefetch_any(std::vector<Box> const& boxes) const = 0;
+    virtual AnyTensor read_tensor_any(
+        Box const& box, std::optional<Area> const& area) const = 0;
+    virtual TissueMask find_tissue_any() const = 0;
+
+    /// Which tiles of level hold data, as (tiles_y, tiles_x) mask.
+    /// Tile compressed over `ratio` times is taken as blank.
+    /// Without decoding, so readers unaware of empty tiles say all do.
+    virtual TissueMask tile_occupancy(Level level, double ratio) const;
     virtual ~Image() noexcept;
+
+    /// Foreground of image, found on first call at `tissue_side`
+    /// resolution. Called with GIL, releases it while mask is found.
+    TissueMask const& tissue() const;
+
+private:
+    std::once_flag mutable _tissue_once;
+    TissueMask mutable _tissue;
 };
 
 } // namespace ts
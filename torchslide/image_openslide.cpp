@@ -1,8 +1,14 @@
+#include <algorithm>
 #include <memory>
 #include <sstream>
+#include <string>
+#include <vector>
 
 #include <openslide/openslide.h>
 
+#include "core/pool.h"
+#include "core/simd.h"
+#include "core/thread_pool.h"
 #include "dispatch.h"
 #include "tensor.h"
 
@@ -35,23 +41,111 @@ struct OpenSlide final : Dispatch<OpenSlide> {
 
     template <class... Ts>
     OpenSlide(
-        File file, std::array<uint8_t, 3> bg_color, Ts&&... args) noexcept
+        Path const& path,
+        File file,
+        std::array<uint8_t, 3> bg_color,
+        Ts&&... args)
       : Dispatch{std::forward<Ts>(args)...}
-      , _file{std::move(file)}
+      , _files{std::move(file), [path] { return File{path}; }}
       , _bg_color{std::move(bg_color)} { }
 
     static std::unique_ptr<Image> make_this(Path const& path);
 
     template <typename T>
-    Tensor<T> read(Box const&) const {
-        throw std::runtime_error{"Not implemented"};
+    Tensor<T> read(Box const& box) const {
+        Tensor<T> result{{box.shape(0), box.shape(1), Size{3}}};
+        this->read_into(box, result);
+        return result;
     }
 
+    template <typename T>
+    void read_into(Box const& box, Tensor<T>& out) const;
+
 private:
-    File _file;
+    /// openslide serializes reads on one handle, so each thread takes own
+    Pool<File> const _files;
     std::array<uint8_t, 3> _bg_color;
+
+    /// Reads `part` of `box` to its place in `out`
+    template <typename T>
+    void _read_part(Box const& box, Box const& part, Tensor<T>& out) const;
+
+    /// Splits `box` to chunks aligned to tiles of its level
+    std::vector<Box> _split(Box const& box) const;
 };
 
+// -------------------------- template definitions --------------------------
+
+/// Composites premultiplied ARGB over background to RGB.
+/// Premultiplied color over background is just `c + bg * (255 - a) / 255`,
+/// so there is no division by alpha, and loop is vectorized by compiler.
+template <typename T>
+_TS_SIMD_CLONES void _argb_to_rgb(
+    uint32_t const* __restrict src,
+    T* __restrict dst,
+    size_t count,
+    std::array<uint8_t, 3> bg) noexcept {
+    uint32_t const bg_r = bg[0], bg_g = bg[1], bg_b = bg[2];
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t const p = src[i];
+        uint32_t const inv = 255 - (p >> 24);
+        uint32_t const r = ((p >> 16) & 0xFF) + (bg_r * inv + 127) / 255;
+        uint32_t const g = ((p >> 8) & 0xFF) + (bg_g * inv + 127) / 255;
+        uint32_t const b = (p & 0xFF) + (bg_b * inv + 127) / 255;
+        dst[3 * i] = static_cast<T>(std::min(r, 255u));
+        dst[3 * i + 1] = static_cast<T>(std::min(g, 255u));
+        dst[3 * i + 2] = static_cast<T>(std::min(b, 255u));
+    }
+}
+
+template <typename T>
+void OpenSlide::read_into(Box const& box, Tensor<T>& out) const {
+    auto parts = this->_split(box);
+    thread_pool().parallel_for(parts.size(), [&](size_t i) {
+        this->_read_part(box, parts[i], out);
+    });
+}
+
+template <typename T>
+void OpenSlide::_read_part(
+    Box const& box, Box const& part, Tensor<T>& out) const {
+    /// ARGB scratch is reused by each thread, so steady-state reads of
+    /// same-sized boxes don't allocate
+    thread_local std::vector<uint32_t> argb;
+    argb.resize(static_cast<size_t>(part.area()));
+
+    auto scale = this->get_scale(this->levels.at(part.level));
+    {
+        auto file = this->_files.acquire();
+        openslide_read_region(
+            *file,
+            argb.data(),
+            part.min_[1] * scale,
+            part.min_[0] * scale,
+            part.level,
+            part.shape(1),
+            part.shape(0));
+        /// Handle stays failed after error, so it's not reused
+        if (char const* error = openslide_get_error(*file)) {
+            std::string message{error};
+            file.discard();
+            throw std::runtime_error{message};
+        }
+    }
+
+    auto const width = part.shape(1);
+    auto* dst = out.data()
+                + ((part.min_[0] - box.min_[0]) * box.shape(1)
+                   + (part.min_[1] - box.min_[1]))
+                      * 3;
+    for (Size y = 0; y < part.shape(0); ++y, dst += box.shape(1) * 3)
+        _argb_to_rgb(
+            argb.data() + y * width,
+            dst,
+            static_cast<size_t>(width),
+            this->_bg_color);
+}
+
 // ------------------------ non-template definitions ------------------------
 
 auto os_open(Path const& path) {
@@ -68,6 +162,25 @@ auto os_open(Path const& path) {
 
 File::File(Path const& path) : _ptr{os_open(path), openslide_close} { }
 
+std::vector<Box> OpenSlide::_split(Box const& box) const {
+    /// chunks of at least 512px, so call overhead stays small
+    auto const& tshape = this->levels.at(box.level).tile_shape;
+    auto const tile_y = std::max(tshape[0], Size{1});
+    auto const tile_x = std::max(tshape[1], Size{1});
+    auto const step_y = tile_y * std::max(Size{512} / tile_y, Size{1});
+    auto const step_x = tile_x * std::max(Size{512} / tile_x, Size{1});
+
+    std::vector<Box> parts;
+    for (auto y = floor(box.min_[0], step_y); y < box.max_[0]; y += step_y)
+        for (auto x = floor(box.min_[1], step_x); x < box.max_[1]; x += step_x)
+            parts.push_back({
+                {std::max(y, box.min_[0]), std::max(x, box.min_[1])},
+                {std::min(y + step_y, box.max_[0]),
+                 std::min(x + step_x, box.max_[1])},
+                box.level});
+    return parts;
+}
+
 std::unique_ptr<Image> OpenSlide::make_this(Path const& path) {
     auto file = File{path};
     auto levels_num = openslide_get_level_count(file);
@@ -85,12 +198,15 @@ std::unique_ptr<Image> OpenSlide::make_this(Path const& path) {
         auto lh = openslide_get_property_value(file, tag_h.c_str());
         auto lw = openslide_get_property_value(file, tag_w.c_str());
 
+        /// not all vendors report tiles, then just split reads evenly
         levels[level]
             = {{static_cast<uint32_t>(y), static_cast<uint32_t>(x), 3},
-               {std::stoi(lh, 0, 10), std::stoi(lw, 0, 10), 3}};
+               {lh ? std::stoi(lh, 0, 10) : 512,
+                lw ? std::stoi(lw, 0, 10) : 512,
+                3}};
     }
 
-    Spacing spacing;
+    Spacing spacing = {};
     int i = 0;
     for (auto tag :
          {OPENSLIDE_PROPERTY_NAME_MPP_Y, OPENSLIDE_PROPERTY_NAME_MPP_X}) {
@@ -111,6 +227,7 @@ std::unique_ptr<Image> OpenSlide::make_this(Path const& path) {
     }
 
     return std::make_unique<OpenSlide>(
+        path,
         std::move(file),
         std::move(bg_color),
         uint8_t{},
@@ -119,28 +236,4 @@ std::unique_ptr<Image> OpenSlide::make_this(Path const& path) {
         std::move(spacing));
 }
 
-template <>
-Tensor<uint8_t> OpenSlide::read(Box const& box) const {
-    Tensor<uint8_t> buf{{box.shape(0), box.shape(1), Size{4}}};
-    auto scale = this->scales()[box.level];
-    openslide_read_region(
-        _file,
-        reinterpret_cast<uint32_t*>(buf.data()),
-        box.min_[1] * scale,
-        box.min_[0] * scale,
-        box.level,
-        box.shape(1),
-        box.shape(0));
-
-    Tensor<uint8_t> result{{box.shape(0), box.shape(1), Size{3}}};
-
-    auto b = buf.template view<3>();
-    auto r = result.template view<3>();
-
-    for (Size y = 0; y < box.shape(0); ++y)
-        for (Size x = 0; x < box.shape(1); ++x)
-            std::reverse_copy(&b({y, x}), &b({y, x, 3}), &r({y, x, 3}));
-    return result;
-}
-
 } // namespace ts::os
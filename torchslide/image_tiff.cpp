@@ -1,13 +1,36 @@
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <limits>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <span>
 #include <stdexcept>
+#include <string>
+#include <tuple>
 #include <vector>
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
 #include <tiffio.h>
 
+#include "cache.h"
+#include "codec_j2k.h"
+#include "codec_jpeg.h"
+#include "core/pool.h"
+#include "core/thread_pool.h"
 #include "core/traits.h"
 #include "dispatch.h"
+#include "ifd.h"
+#include "mapping.h"
+#include "sidecar.h"
 #include "tensor.h"
 
 #define _TIFF_JPEG2K_YUV 33003
@@ -36,33 +59,213 @@ struct File {
     template <typename T>
     std::optional<T> get_defaulted(uint32 tag) const noexcept;
 
+    /// Reads `size` bytes at `offset` without touching libtiff's state
+    int64_t read_at(uint64_t offset, void* data, uint64_t size) const noexcept;
+
 private:
     std::unique_ptr<TIFF, void (*)(TIFF*)> _ptr;
 };
 
+/// Level's tags parsed once on open, so raw tiles can be located
+/// without switching directories
+struct Directory {
+    uint16_t compression = COMPRESSION_NONE;
+    uint16_t photometric = PHOTOMETRIC_MINISBLACK;
+    bool swapped = false;
+    uint32_t tiles_x = 0;
+    std::vector<uint64_t> offsets = {};
+    std::vector<uint64_t> bytecounts = {};
+    std::vector<uint8_t> jpeg_tables = {};
+
+    size_t position(LevelInfo const& info, uint32_t iy, uint32_t ix)
+        const noexcept {
+        return static_cast<size_t>(iy / info.tile_shape[0]) * tiles_x
+               + static_cast<size_t>(ix / info.tile_shape[1]);
+    }
+
+    bool j2k() const noexcept {
+        return compression == _TIFF_JPEG2K_YUV
+               || compression == _TIFF_JPEG2K_RGB;
+    }
+
+    j2k::Color j2k_color() const noexcept {
+        return (compression == _TIFF_JPEG2K_YUV) ? j2k::Color::YCbCr
+                                                 : j2k::Color::RGB;
+    }
+};
+
+/// Background, i.e. value of pixels of tiles missing from file and of
+/// area beyond image. Brightfield glass is white, as is zero of
+/// MINISWHITE, while MINISBLACK (i.e. fluorescence or masks) is dark.
+template <typename T>
+T _fill_value(Directory const& dir) noexcept {
+    if (dir.photometric == PHOTOMETRIC_MINISBLACK
+        || dir.photometric == PHOTOMETRIC_MINISWHITE)
+        return T{};
+    if constexpr (std::is_floating_point_v<T>)
+        return T{1};
+    else
+        return std::numeric_limits<T>::max();
+}
+
 struct TiffImage final : Dispatch<TiffImage> {
     static inline constexpr int priority = 0;
     static inline constexpr char const* extensions[]
         = {".svs", ".tif", ".tiff"};
 
+    /// Either `file` with parsed `dirs` is given, or `ifds` of `mapping`
+    /// for lazy open, then libtiff isn't touched until pixels need it
     template <class... Ts>
-    TiffImage(File file, uint16_t codec, Ts&&... args) noexcept
+    TiffImage(
+        Path const& path,
+        std::optional<File> file,
+        std::optional<Mapping> mapping,
+        std::vector<ifd::Ifd> ifds,
+        std::map<Level, Directory> dirs,
+        Ts&&... args)
       : Dispatch{std::forward<Ts>(args)...}
-      , _file{std::move(file)}
-      , _codec{codec} { }
+      , _path{path}
+      , _files(_make_pool(path, std::move(file)))
+      , _mapping{std::move(mapping)}
+      , _ifds{std::move(ifds)}
+      , _dirs{std::move(dirs)} { }
 
     static std::unique_ptr<Image> make_this(Path const& path);
 
+    static std::unique_ptr<Image>
+    restore_this(Path const& path, std::span<uint8_t const> state);
+
+    std::vector<uint8_t> state() const override;
+
+    TissueMask tile_occupancy(Level level, double ratio) const override;
+
     template <typename T>
     Tensor<T> read(Box const& box) const;
 
+    template <typename T>
+    void read_into(Box const& box, Tensor<T>& out) const;
+
+    template <typename T>
+    void read_batch(std::vector<Box> const& boxes, Tensor<T>& out) const;
+
+    template <typename T>
+    void prefetch(std::vector<Box> const& boxes) const;
+
 private:
-    File const _file;
-    uint16_t const _codec = 0;
-    std::mutex mutable _mutex;
+    using _Corner = std::pair<Size, Size>;
+
+    /// Tag of TIFF indices in sidecar
+    static constexpr uint32_t _index_kind = 0x46464954;
+
+    Path const _path;
+    /// Handles to the same file, so threads can read it independently
+    Pool<File> const _files;
+    /// Raw tiles are taken from mapping when present, otherwise via pread
+    std::optional<Mapping> const _mapping;
+    /// IFDs of lazily opened file, their tile tables are parsed on first read
+    std::vector<ifd::Ifd> const _ifds;
+    std::once_flag mutable _dirs_once;
+    std::map<Level, Directory> mutable _dirs;
+
+    static Pool<File> _make_pool(Path const& path, std::optional<File> file);
+
+    Directory const& _dir(Level level) const;
+
+    /// Metadata and tile tables, as kept in sidecar index and pickle
+    sidecar::Writer _index() const;
+
+    /// Stores `_index()` to sidecar for next opens
+    void _save_index() const;
+
+    static std::unique_ptr<Image>
+    _make_indexed(Path const& path, sidecar::Reader r);
+
+    /// Tiles compressed over this ratio are looked up in `_blanks`
+    static constexpr double _sparse_ratio = 64;
+    /// Limit of distinct blank tiles kept per image
+    static constexpr size_t _max_blanks = 16;
+
+    /// Decoded sparse tiles by raw content. Scanners store blank tiles
+    /// as the same tiny JPEG, so these are decoded once per level and
+    /// kept out of `tile_cache()`. Once full table misses, sparse tiles
+    /// aren't all blank, so it's dropped and lookups stop.
+    std::mutex mutable _blanks_mutex;
+    std::atomic<bool> mutable _blanks_off = false;
+    std::map<
+        std::tuple<Level, uint8_t, std::string>,
+        std::shared_ptr<AnyTensor const>> mutable _blanks;
+    /// Background tiles for ones missing from file
+    std::map<std::pair<Level, uint8_t>, std::shared_ptr<AnyTensor const>>
+        mutable _fills;
+
+    bool _is_sparse(LevelInfo const& info, uint64_t bytes, double ratio)
+        const noexcept {
+        auto const& shape = info.tile_shape;
+        auto const size = static_cast<uint64_t>(shape[0] * shape[1] * shape[2])
+                          * std::visit([](auto v) { return sizeof(v); },
+                                       this->dtype);
+        return static_cast<double>(bytes) * ratio < static_cast<double>(size);
+    }
+
+    /// Shared tile for missing or blank tile at (iy, ix), nullptr for
+    /// regular one
+    template <typename T>
+    std::shared_ptr<Tensor<T> const>
+    _read_blank(Level level, uint8_t reduce, uint32_t iy, uint32_t ix) const;
+
+    /// Identity of this image in `tile_cache()`, never reused
+    inline static std::atomic<size_t> _uids = 0;
+    size_t const _uid = ++_uids;
+
+    /// Raw bytes of tile, either view into file mapping or read to `buf`
+    std::span<uint8_t const> _read_raw(
+        Directory const& dir, size_t pos, std::vector<uint8_t>& buf) const;
+
+    /// Level as seen by `box`, i.e. reduced by codec
+    LevelInfo _info(Box const& box) const noexcept {
+        return this->levels.at(box.level).reduced(box.reduce);
+    }
 
     template <typename T>
-    Tensor<T> _read_at(Level level, uint32_t iy, uint32_t ix) const;
+    Tensor<T>
+    _decode_at(Level level, uint8_t reduce, uint32_t iy, uint32_t ix) const;
+
+    template <typename T>
+    std::shared_ptr<Tensor<T> const>
+    _read_at(Level level, uint8_t reduce, uint32_t iy, uint32_t ix) const;
+
+    /// Whether only overlap of `box` with tile at (iy, ix) should be
+    /// decoded, bypassing cache. True for J2K tiles mostly out of `box`.
+    bool _is_partial(Box const& box, Size iy, Size ix) const;
+
+    /// Decodes only part of tile at (iy, ix) which overlaps with `box`
+    /// directly to `out`
+    template <typename T>
+    void
+    _decode_part(Box const& box, Tensor<T>& out, Size iy, Size ix) const;
+
+    /// Decodes all tiles touched by `boxes` (of the same level) in parallel.
+    /// Returns index of each tile's corner in vector of decoded tiles.
+    template <typename T>
+    auto _read_tiles(std::vector<Box> const& boxes) const;
+
+    /// Copies part of tile at (iy, ix) which overlaps with `box` to `out`
+    template <typename T>
+    void _paste(
+        Box const& box,
+        Tensor<T>& out,
+        Tensor<T> const& tile,
+        Size iy,
+        Size ix) const;
+
+    /// Extends `crop` to tile boundaries
+    static Box _grid(Box const& crop, Shape const& tshape) noexcept {
+        return {
+            {floor(crop.min_[0], tshape[0]), floor(crop.min_[1], tshape[1])},
+            {ceil(crop.max_[0], tshape[0]), ceil(crop.max_[1], tshape[1])},
+            crop.level,
+            crop.reduce};
+    }
 };
 
 // -------------------------- template definitions --------------------------
@@ -90,81 +293,331 @@ std::optional<T> File::get_defaulted(uint32 tag) const noexcept {
     return {};
 }
 
+/// `iy` and `ix` are in coordinates of reduced level
 template <typename T>
-Tensor<T> TiffImage::_read_at(Level level, uint32_t iy, uint32_t ix) const {
-    auto const& shape = this->levels.at(level).tile_shape;
-
-    std::unique_lock lk{this->_mutex};
-    TIFFSetDirectory(this->_file, level);
+Tensor<T> TiffImage::_decode_at(
+    Level level, uint8_t reduce, uint32_t iy, uint32_t ix) const {
+    auto const& info = this->levels.at(level);
+    auto const shape = info.reduced(reduce).tile_shape;
+    auto const& dir = this->_dir(level);
 
     auto tile = Tensor<T>{shape};
-    if (this->samples == 4) {
-        Tensor<T> buf{shape};
-        TIFFReadRGBATile(this->_file, ix, iy, (uint32*)buf.data());
+    auto const pos = dir.position(info, iy << reduce, ix << reduce);
+    bool const rgba = !dir.j2k()
+                      && (this->samples == 4
+                          || (dir.photometric == PHOTOMETRIC_YCBCR
+                              && dir.compression != COMPRESSION_JPEG));
+
+    if (dir.compression == COMPRESSION_NONE && !rgba && !reduce
+        && (sizeof(T) == 1 || !dir.swapped)) {
+        thread_local std::vector<uint8_t> buf;
+        auto raw = this->_read_raw(dir, pos, buf);
+        std::memcpy(
+            tile.data(), raw.data(), std::min(raw.size(), nbytes(tile)));
+        return tile;
+    }
+
+    if constexpr (std::is_same_v<T, uint8_t>)
+        if (dir.compression == COMPRESSION_JPEG && !rgba) {
+            thread_local std::vector<uint8_t> buf;
+            auto raw = this->_read_raw(dir, pos, buf);
+            auto color = (dir.photometric == PHOTOMETRIC_YCBCR)
+                             ? jpeg::Color::YCbCr
+                             : (dir.photometric == PHOTOMETRIC_RGB)
+                                   ? jpeg::Color::RGB
+                                   : jpeg::Color::Gray;
+            jpeg::decode(raw, dir.jpeg_tables, color, tile, 1u << reduce);
+            return tile;
+        }
+
+    if (dir.j2k()) {
+        thread_local std::vector<uint8_t> buf;
+        auto raw = this->_read_raw(dir, pos, buf);
+        auto result = j2k::decode(raw, dir.j2k_color(), tile, reduce);
+        if (auto* error = std::get_if<j2k::Error>(&result))
+            throw std::runtime_error{"JPEG2000: " + *error};
+        return tile;
+    }
+
+    /// `reductions` are set only for levels decodable above
+    if (reduce)
+        throw std::runtime_error{"Tile can't be decoded at reduced size"};
+
+    auto file = this->_files.acquire();
+
+    /// Each handle stays at last used level, so IFD is re-parsed only
+    /// when thread switches to another level
+    if (TIFFCurrentDirectory(*file) != level)
+        TIFFSetDirectory(*file, level);
+
+    if (rgba) {
+        /// RGBA raster is bottom-up, so flip it
+        Tensor<T> buf{std::vector<Size>{shape[0], shape[1], 4}};
+        TIFFReadRGBATile(*file, ix, iy, (uint32*)buf.data());
         auto b = buf.template view<3>();
         auto t = tile.template view<3>();
         for (Size y = 0; y < shape[0]; ++y)
-            std::copy(&b({y}), &b({y + 1}), &t({shape[0] - y - 1}));
+            for (Size x = 0; x < shape[1]; ++x)
+                std::copy_n(
+                    &b({shape[0] - y - 1, x}), this->samples, &t({y, x}));
     } else
-        TIFFReadTile(this->_file, tile.data(), ix, iy, 0, 0);
-
-    TIFFFreeDirectory(this->_file);
+        TIFFReadTile(*file, tile.data(), ix, iy, 0, 0);
     return tile;
 }
 
 template <typename T>
-Tensor<T> TiffImage::read(Box const& box) const {
-    auto const& shape = this->levels.at(box.level).shape;
-    auto crop = box.fit_to(shape);
-    if (!crop.area())
-        return Tensor<T>{{box.shape(0), box.shape(1), this->samples}};
-
-    auto const& tshape = this->levels.at(box.level).tile_shape;
-    Size min_[] = {
-        floor(crop.min_[0], tshape[0]),
-        floor(crop.min_[1], tshape[1]),
-    };
-    Size max_[] = {
-        ceil(crop.max_[0], tshape[0]),
-        ceil(crop.max_[1], tshape[1]),
+std::shared_ptr<Tensor<T> const>
+TiffImage::_read_blank(
+    Level level, uint8_t reduce, uint32_t iy, uint32_t ix) const {
+    auto const& info = this->levels.at(level);
+    auto const& dir = this->_dir(level);
+    auto const pos = dir.position(info, iy << reduce, ix << reduce);
+    auto const bytes = dir.bytecounts.at(pos);
+    auto const unwrap = [](std::shared_ptr<AnyTensor const> const& ptr) {
+        return std::shared_ptr<Tensor<T> const>{
+            ptr, &std::get<Tensor<T>>(*ptr)};
     };
 
+    if (!bytes) {
+        std::unique_lock lk{this->_blanks_mutex};
+        auto& ptr = this->_fills[{level, reduce}];
+        if (!ptr) {
+            Tensor<T> tile{info.reduced(reduce).tile_shape};
+            std::fill_n(
+                tile.data(), tile.storage().size(), _fill_value<T>(dir));
+            ptr = std::make_shared<AnyTensor const>(std::move(tile));
+        }
+        return unwrap(ptr);
+    }
+    if (this->_blanks_off.load(std::memory_order_relaxed)
+        || !this->_is_sparse(info, bytes, _sparse_ratio))
+        return {};
+
+    thread_local std::vector<uint8_t> buf;
+    auto raw = this->_read_raw(dir, pos, buf);
+    auto key = std::tuple{level, reduce, std::string{raw.begin(), raw.end()}};
+    {
+        std::unique_lock lk{this->_blanks_mutex};
+        if (auto it = this->_blanks.find(key); it != this->_blanks.end())
+            return unwrap(it->second);
+        if (this->_blanks.size() >= _max_blanks) {
+            this->_blanks.clear();
+            this->_blanks_off = true;
+            return {};
+        }
+    }
+
+    auto ptr = std::make_shared<AnyTensor const>(
+        this->_decode_at<T>(level, reduce, iy, ix));
+
+    std::unique_lock lk{this->_blanks_mutex};
+    if (this->_blanks_off)
+        return unwrap(ptr);
+    auto [it, _] = this->_blanks.emplace(std::move(key), std::move(ptr));
+    return unwrap(it->second);
+}
+
+template <typename T>
+std::shared_ptr<Tensor<T> const>
+TiffImage::_read_at(
+    Level level, uint8_t reduce, uint32_t iy, uint32_t ix) const {
+    if (auto blank = this->_read_blank<T>(level, reduce, iy, ix))
+        return blank;
+
+    auto key = TileKey{this->_uid, level, reduce, iy, ix};
+    auto ptr = tile_cache()(key, [&, this]() {
+        return AnyTensor{this->_decode_at<T>(level, reduce, iy, ix)};
+    });
+    return {ptr, &std::get<Tensor<T>>(*ptr)};
+}
+
+template <typename T>
+void TiffImage::_decode_part(
+    Box const& box, Tensor<T>& out, Size iy, Size ix) const {
+    auto const info = this->_info(box);
+    auto const& shape = info.shape;
+    auto const& tshape = info.tile_shape;
+    auto const& dir = this->_dir(box.level);
+
+    Box part{
+        {std::max(box.min_[0], iy) - iy, std::max(box.min_[1], ix) - ix},
+        {std::min({box.max_[0], iy + tshape[0], shape[0]}) - iy,
+         std::min({box.max_[1], ix + tshape[1], shape[1]}) - ix},
+        box.level,
+        box.reduce};
+    Tensor<T> tile{std::vector<Size>{part.shape(0), part.shape(1), this->samples}};
+
+    thread_local std::vector<uint8_t> buf;
+    auto raw = this->_read_raw(
+        dir,
+        dir.position(
+            this->levels.at(box.level), iy << box.reduce, ix << box.reduce),
+        buf);
+    if (raw.empty())
+        std::fill_n(
+            tile.data(), tile.storage().size(), _fill_value<T>(dir));
+    else if (auto result
+             = j2k::decode(raw, dir.j2k_color(), tile, box.reduce, part);
+             auto* error = std::get_if<j2k::Error>(&result))
+        throw std::runtime_error{"JPEG2000: " + *error};
+
+    auto t = tile.template view<3>();
+    auto o = out.template view<3>();
+    auto out_y = iy + part.min_[0] - box.min_[0];
+    auto out_x = ix + part.min_[1] - box.min_[1];
+    for (Size y = 0; y < part.shape(0); ++y)
+        std::copy_n(
+            &t({y}), part.shape(1) * this->samples, &o({out_y + y, out_x}));
+}
+
+template <typename T>
+Tensor<T> TiffImage::read(Box const& box) const {
+    auto const info = this->_info(box);
+    auto const& shape = info.shape;
+    auto const& tshape = info.tile_shape;
+
     /// read exact one tile
-    if ((min_[0] == crop.min_[0]) && (min_[0] + tshape[0] == crop.max_[0])
-        && (min_[1] == crop.min_[1]) && (min_[1] + tshape[1] == crop.max_[1]))
-        return this->_read_at<T>(
+    if (box.fit_to(shape).area() == box.area()
+        && box.min_[0] % tshape[0] == 0 && box.shape(0) == tshape[0]
+        && box.min_[1] % tshape[1] == 0 && box.shape(1) == tshape[1])
+        return *this->_read_at<T>(
             box.level,
-            static_cast<uint32_t>(min_[0]),
-            static_cast<uint32_t>(min_[1]));
+            box.reduce,
+            static_cast<uint32_t>(box.min_[0]),
+            static_cast<uint32_t>(box.min_[1]));
 
-    /// combine tile from small ones
     Tensor<T> result{{box.shape(0), box.shape(1), this->samples}};
-    for (auto iy = min_[0]; iy < max_[0]; iy += tshape[0])
-        for (auto ix = min_[1]; ix < max_[1]; ix += tshape[1]) {
-            auto const tile = this->_read_at<T>(
-                box.level,
-                static_cast<uint32_t>(iy),
-                static_cast<uint32_t>(ix));
-
-            auto t = tile.template view<3>();
-            auto ty_begin = std::max(box.min_[0], iy);
-            auto tx_begin = std::max(box.min_[1], ix);
-            auto ty_end = std::min({box.max_[0], iy + tshape[0], shape[0]});
-            auto tx_end = std::min({box.max_[1], ix + tshape[1], shape[1]});
-
-            auto out = result.template view<3>();
-            auto out_y = ty_begin - box.min_[0];
-            auto out_x = tx_begin - box.min_[1];
-
-            for (auto ty = ty_begin; ty < ty_end; ++ty, ++out_y)
-                std::copy(
-                    &t({ty - iy, tx_begin - ix}),
-                    &t({ty - iy, tx_end - ix}),
-                    &out({out_y, out_x}));
-        }
+    this->read_into(box, result);
     return result;
 }
 
+template <typename T>
+void TiffImage::read_into(Box const& box, Tensor<T>& out) const {
+    auto const info = this->_info(box);
+    auto crop = box.fit_to(info.shape);
+    if (crop.area() != box.area())
+        std::fill_n(
+            out.data(),
+            box.area() * this->samples,
+            _fill_value<T>(this->_dir(box.level)));
+    if (!crop.area())
+        return;
+
+    /// combine tile from small ones, decoding them in parallel
+    auto const& tshape = info.tile_shape;
+    auto const grid = _grid(crop, tshape);
+    auto const tiles_x = grid.shape(1) / tshape[1];
+    auto const tiles = tiles_x * (grid.shape(0) / tshape[0]);
+
+    thread_pool().parallel_for(tiles, [&](size_t i) {
+        auto iy = grid.min_[0] + static_cast<Size>(i) / tiles_x * tshape[0];
+        auto ix = grid.min_[1] + static_cast<Size>(i) % tiles_x * tshape[1];
+        if (this->_is_partial(box, iy, ix))
+            return this->_decode_part(box, out, iy, ix);
+
+        auto const tile = this->_read_at<T>(
+            box.level,
+            box.reduce,
+            static_cast<uint32_t>(iy),
+            static_cast<uint32_t>(ix));
+        this->_paste(box, out, *tile, iy, ix);
+    });
+}
+
+template <typename T>
+auto TiffImage::_read_tiles(std::vector<Box> const& boxes) const {
+    /// collect tiles shared by boxes, so each is decoded only once
+    std::map<_Corner, size_t> slots;
+    for (auto const& box : boxes) {
+        auto const info = this->_info(box);
+        auto crop = box.fit_to(info.shape);
+        if (!crop.area())
+            continue;
+        auto const& tshape = info.tile_shape;
+        auto const grid = _grid(crop, tshape);
+        for (auto iy = grid.min_[0]; iy < grid.max_[0]; iy += tshape[0])
+            for (auto ix = grid.min_[1]; ix < grid.max_[1]; ix += tshape[1])
+                slots.emplace(_Corner{iy, ix}, slots.size());
+    }
+
+    std::vector<_Corner> corners(slots.size());
+    for (auto const& [corner, slot] : slots)
+        corners[slot] = corner;
+
+    auto const level = boxes.empty() ? Level{} : boxes.front().level;
+    auto const reduce = boxes.empty() ? uint8_t{} : boxes.front().reduce;
+    std::vector<std::shared_ptr<Tensor<T> const>> decoded(slots.size());
+    thread_pool().parallel_for(corners.size(), [&](size_t i) {
+        decoded[i] = this->_read_at<T>(
+            level,
+            reduce,
+            static_cast<uint32_t>(corners[i].first),
+            static_cast<uint32_t>(corners[i].second));
+    });
+    return std::pair{std::move(slots), std::move(decoded)};
+}
+
+template <typename T>
+void TiffImage::prefetch(std::vector<Box> const& boxes) const {
+    this->_read_tiles<T>(boxes);
+}
+
+template <typename T>
+void TiffImage::read_batch(std::vector<Box> const& boxes, Tensor<T>& out) const {
+    if (boxes.empty())
+        return;
+
+    auto const info = this->_info(boxes.front());
+    auto const& tshape = info.tile_shape;
+    auto const tiles = this->_read_tiles<T>(boxes);
+    auto const& [slots, decoded] = tiles;
+
+    auto const stride = boxes.front().area() * this->samples;
+    thread_pool().parallel_for(boxes.size(), [&](size_t i) {
+        auto const& box = boxes[i];
+        Tensor<T> o{
+            {box.shape(0), box.shape(1), this->samples},
+            out.data() + i * stride};
+
+        auto crop = box.fit_to(info.shape);
+        if (crop.area() != box.area())
+            std::fill_n(
+                o.data(), stride, _fill_value<T>(this->_dir(box.level)));
+        if (!crop.area())
+            return;
+
+        auto const grid = _grid(crop, tshape);
+        for (auto iy = grid.min_[0]; iy < grid.max_[0]; iy += tshape[0])
+            for (auto ix = grid.min_[1]; ix < grid.max_[1]; ix += tshape[1])
+                this->_paste(box, o, *decoded[slots.at({iy, ix})], iy, ix);
+    });
+}
+
+template <typename T>
+void TiffImage::_paste(
+    Box const& box, Tensor<T>& out, Tensor<T> const& tile, Size iy, Size ix
+) const {
+    auto const info = this->_info(box);
+    auto const& shape = info.shape;
+    auto const& tshape = info.tile_shape;
+
+    auto t = tile.template view<3>();
+    auto ty_begin = std::max(box.min_[0], iy);
+    auto tx_begin = std::max(box.min_[1], ix);
+    auto ty_end = std::min({box.max_[0], iy + tshape[0], shape[0]});
+    auto tx_end = std::min({box.max_[1], ix + tshape[1], shape[1]});
+
+    auto o = out.template view<3>();
+    auto out_y = ty_begin - box.min_[0];
+    auto out_x = tx_begin - box.min_[1];
+
+    for (auto ty = ty_begin; ty < ty_end; ++ty, ++out_y)
+        std::copy(
+            &t({ty - iy, tx_begin - ix}),
+            &t({ty - iy, tx_end - ix}),
+            &o({out_y, out_x}));
+}
+
 // ------------------------ non-template definitions ------------------------
 
 auto tiff_open(Path const& path, std::string const& flags) {
@@ -188,13 +641,39 @@ uint32_t File::position(uint32_t iy, uint32_t ix) const noexcept {
 
 uint32_t File::tiles() const noexcept { return TIFFNumberOfTiles(*this); }
 
-DType _get_dtype(File const& f) {
-    auto dtype = f.try_get<uint16_t>(TIFFTAG_SAMPLEFORMAT)
-                     .value_or(SAMPLEFORMAT_UINT);
+int64_t
+File::read_at(uint64_t offset, void* data, uint64_t size) const noexcept {
+#ifdef _WIN32
+    OVERLAPPED ov = {};
+    ov.Offset = static_cast<DWORD>(offset);
+    ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD count = 0;
+    if (!ReadFile(
+            static_cast<HANDLE>(TIFFClientdata(*this)),
+            data,
+            static_cast<DWORD>(size),
+            &count,
+            &ov))
+        return -1;
+    return count;
+#else
+    auto fd = static_cast<int>(
+        reinterpret_cast<intptr_t>(TIFFClientdata(*this)));
+    return pread(fd, data, size, static_cast<off_t>(offset));
+#endif
+}
+
+void _check_description(std::string_view descr) {
+    if (descr.find("DICOM") != std::string::npos
+        || descr.find("xml") != std::string::npos
+        || descr.find("XML") != std::string::npos)
+        throw std::runtime_error{"Unsupported format: " + std::string{descr}};
+}
+
+DType _get_dtype(uint64_t dtype, uint64_t bitdepth) {
     if (dtype != SAMPLEFORMAT_UINT && dtype != SAMPLEFORMAT_IEEEFP)
         throw std::runtime_error{"Unsupported data type"};
 
-    auto bitdepth = f.get<uint16_t>(TIFFTAG_BITSPERSAMPLE);
     auto const is_compatible = [dtype, bitdepth](auto v) -> bool {
         if (bitdepth != sizeof(v) * 8)
             return false;
@@ -210,29 +689,157 @@ DType _get_dtype(File const& f) {
         "Unsupported bitdepth " + std::to_string(bitdepth)};
 }
 
-Size _get_samples(File const& f) {
-    auto ctype = f.get<uint16_t>(TIFFTAG_PHOTOMETRIC);
+Size _get_samples(uint64_t ctype, uint64_t samples, uint64_t codec) {
     switch (ctype) {
     case PHOTOMETRIC_MINISBLACK: {
-        auto samples = f.get<uint16_t>(TIFFTAG_SAMPLESPERPIXEL);
         if (samples == 1)
             return samples;
         throw std::runtime_error{"Indexed color is not supported"};
     }
     case PHOTOMETRIC_RGB: {
-        auto samples = f.get<uint16_t>(TIFFTAG_SAMPLESPERPIXEL);
         if (samples == 3 || samples == 4)
             return samples;
         throw std::runtime_error{
             "Unsupported sample count: " + std::to_string(samples)};
     }
     case PHOTOMETRIC_YCBCR:
-        return 4;
+        /// JPEG decoders convert to RGB themselves, others go through RGBA
+        return (codec == COMPRESSION_JPEG || codec == _TIFF_JPEG2K_YUV
+                || codec == _TIFF_JPEG2K_RGB)
+                   ? 3
+                   : 4;
     default:
         throw std::runtime_error{"Unsupported color type"};
     }
 }
 
+/// Required by TIFF, but some writers omit it
+uint16_t _get_photometric(std::optional<uint64_t> value) {
+    if (!value)
+        throw std::runtime_error{"Tiff has no photometric interpretation"};
+    return static_cast<uint16_t>(*value);
+}
+
+/// Pixel size from resolution in pixels per cm, zeros if it's unknown
+Spacing
+_get_spacing(std::optional<double> y_res, std::optional<double> x_res) {
+    if (!y_res || !x_res || *y_res <= 0 || *x_res <= 0)
+        return {};
+    return {
+        static_cast<float>(10000 / *y_res),
+        static_cast<float>(10000 / *x_res)};
+}
+
+bool TiffImage::_is_partial(Box const& box, Size iy, Size ix) const {
+    if (!this->_dir(box.level).j2k())
+        return false;
+
+    /// whole tile is worth decoding only when most of it is used,
+    /// otherwise J2K runs wavelet only for covered code-blocks
+    auto const& tshape = this->_info(box).tile_shape;
+    auto h = std::min(box.max_[0], iy + tshape[0]) - std::max(box.min_[0], iy);
+    auto w = std::min(box.max_[1], ix + tshape[1]) - std::max(box.min_[1], ix);
+    return 4 * h * w < tshape[0] * tshape[1];
+}
+
+std::span<uint8_t const> TiffImage::_read_raw(
+    Directory const& dir, size_t pos, std::vector<uint8_t>& buf) const {
+    auto offset = dir.offsets.at(pos);
+    auto size = dir.bytecounts.at(pos);
+    if (this->_mapping)
+        if (auto raw = this->_mapping->view(offset, size); raw.size() == size)
+            return raw;
+
+    buf.resize(size);
+    auto count = this->_files.acquire()->read_at(offset, buf.data(), size);
+    return {buf.data(), static_cast<size_t>(std::max<int64_t>(count, 0))};
+}
+
+Directory _read_directory(File const& f) {
+    Directory dir;
+    dir.compression = f.get_defaulted<uint16_t>(TIFFTAG_COMPRESSION)
+                          .value_or(COMPRESSION_NONE);
+    dir.photometric
+        = _get_photometric(f.try_get<uint16_t>(TIFFTAG_PHOTOMETRIC));
+    dir.swapped = TIFFIsByteSwapped(f);
+
+    auto tile_w = f.get<uint32_t>(TIFFTAG_TILEWIDTH);
+    dir.tiles_x = (f.get<uint32_t>(TIFFTAG_IMAGEWIDTH) + tile_w - 1) / tile_w;
+
+    auto tiles = f.tiles();
+    if (auto ptr = f.try_get<uint64_t*>(TIFFTAG_TILEOFFSETS))
+        dir.offsets.assign(*ptr, *ptr + tiles);
+    if (auto ptr = f.try_get<uint64_t*>(TIFFTAG_TILEBYTECOUNTS))
+        dir.bytecounts.assign(*ptr, *ptr + tiles);
+    if (dir.offsets.size() != tiles || dir.bytecounts.size() != tiles)
+        throw std::runtime_error{"Tiff has broken tile index"};
+
+    uint32_t count = 0;
+    void* tables = nullptr;
+    if (TIFFGetField(f, TIFFTAG_JPEGTABLES, &count, &tables) && count)
+        dir.jpeg_tables.assign(
+            static_cast<uint8_t*>(tables),
+            static_cast<uint8_t*>(tables) + count);
+    return dir;
+}
+
+Directory _read_directory(ifd::Ifd const& d) {
+    Directory dir;
+    dir.compression = static_cast<uint16_t>(
+        d.get(TIFFTAG_COMPRESSION).value_or(COMPRESSION_NONE));
+    dir.photometric = _get_photometric(d.get(TIFFTAG_PHOTOMETRIC));
+    dir.swapped = d.big_endian() != (std::endian::native == std::endian::big);
+
+    auto tile_w = d.get(TIFFTAG_TILEWIDTH).value_or(1);
+    auto tile_h = d.get(TIFFTAG_TILELENGTH).value_or(1);
+    auto w = d.get(TIFFTAG_IMAGEWIDTH).value_or(0);
+    auto h = d.get(TIFFTAG_IMAGELENGTH).value_or(0);
+    dir.tiles_x = static_cast<uint32_t>((w + tile_w - 1) / tile_w);
+
+    auto tiles = dir.tiles_x * ((h + tile_h - 1) / tile_h);
+    dir.offsets = d.get_array(TIFFTAG_TILEOFFSETS);
+    dir.bytecounts = d.get_array(TIFFTAG_TILEBYTECOUNTS);
+    if (dir.offsets.size() != tiles || dir.bytecounts.size() != tiles)
+        throw std::runtime_error{"Tiff has broken tile index"};
+
+    auto tables = d.get_bytes(TIFFTAG_JPEGTABLES);
+    dir.jpeg_tables.assign(tables.begin(), tables.end());
+    return dir;
+}
+
+/// How many times tile can be halved by its codec, staying aligned
+/// to pixel grid. libjpeg can scale 8-bit tiles down to 1/8 while
+/// decoding, J2K - down to its coarsest wavelet level.
+uint8_t _get_reductions(
+    Shape const& tile_shape,
+    uint64_t codec,
+    Size samples,
+    uint64_t bitdepth,
+    std::span<uint8_t const> j2k_head) {
+    size_t limit = 0;
+    if (codec == COMPRESSION_JPEG && samples != 4 && bitdepth == 8)
+        limit = 3;
+    else if (codec == _TIFF_JPEG2K_YUV || codec == _TIFF_JPEG2K_RGB)
+        limit = j2k::decompositions(j2k_head);
+
+    uint8_t reductions = 0;
+    while (reductions < limit && tile_shape[0] % (2 << reductions) == 0
+           && tile_shape[1] % (2 << reductions) == 0)
+        ++reductions;
+    return reductions;
+}
+
+/// Main header of J2K codestream is in the first bytes of any tile
+std::vector<uint8_t> _j2k_head(File const& f, Directory const& dir) {
+    if (dir.offsets.empty())
+        return {};
+    std::vector<uint8_t> head(std::min<uint64_t>(dir.bytecounts.front(), 1024));
+    auto size = static_cast<int64_t>(head.size());
+    if (f.read_at(dir.offsets.front(), head.data(), head.size()) != size)
+        return {};
+    return head;
+}
+
 auto _read_pyramid(File const& f, Size samples) {
     TIFFSetDirectory(f, 0);
     Level level_count = TIFFNumberOfDirectories(f);
@@ -241,6 +848,7 @@ auto _read_pyramid(File const& f, Size samples) {
 
     // TODO: make std::map<Scale, std::pair<Level, LevelInfo>>
     std::map<Level, LevelInfo> levels;
+    std::map<Level, Directory> dirs;
     for (Level level = 0; level < level_count; ++level) {
         TIFFSetDirectory(f, level);
         if (!TIFFIsTiled(f))
@@ -252,47 +860,262 @@ auto _read_pyramid(File const& f, Size samples) {
                {f.get<uint32_t>(TIFFTAG_TILELENGTH),
                 f.get<uint32_t>(TIFFTAG_TILEWIDTH),
                 samples}};
-        TIFFFreeDirectory(f);
+        auto const& dir = dirs[level] = _read_directory(f);
+
+        std::vector<uint8_t> head;
+        if (dir.j2k())
+            head = _j2k_head(f, dir);
+        auto& info = levels[level];
+        info.reductions = _get_reductions(
+            info.tile_shape,
+            dir.compression,
+            samples,
+            f.get<uint16_t>(TIFFTAG_BITSPERSAMPLE),
+            head);
     }
     TIFFSetDirectory(f, 0);
-    return levels;
+    return std::pair{std::move(levels), std::move(dirs)};
+}
+
+std::optional<Mapping> _try_map(Path const& path) noexcept {
+    /// whole-file mapping won't fit into 32-bit address space
+    if constexpr (sizeof(void*) < 8)
+        return {};
+    try {
+        return Mapping{path};
+    } catch (...) {
+        return {};
+    }
+}
+
+Pool<File>
+TiffImage::_make_pool(Path const& path, std::optional<File> file) {
+    auto factory = [path] { return File{path, "rm"}; };
+    if (file)
+        return {std::move(*file), factory};
+    return {factory};
+}
+
+Directory const& TiffImage::_dir(Level level) const {
+    std::call_once(this->_dirs_once, [this] {
+        if (this->_ifds.empty())
+            return;
+        for (auto const& [key, _] : this->levels)
+            this->_dirs.emplace(key, _read_directory(this->_ifds.at(key)));
+        this->_save_index();
+    });
+    return this->_dirs.at(level);
+}
+
+sidecar::Writer TiffImage::_index() const {
+    sidecar::Writer w;
+    w.put(static_cast<ImageInfo const&>(*this));
+    for (auto const& [level, dir] : this->_dirs) {
+        w.put(level);
+        w.put(dir.compression);
+        w.put(dir.photometric);
+        w.put(dir.swapped);
+        w.put(dir.tiles_x);
+        w.put(dir.offsets);
+        w.put(dir.bytecounts);
+        w.put(dir.jpeg_tables);
+    }
+    return w;
+}
+
+void TiffImage::_save_index() const {
+    if (sidecar::get_dir().empty())
+        return;
+    sidecar::save(
+        this->_path, sidecar::pack(this->_path, _index_kind, this->_index()));
+}
+
+TissueMask TiffImage::tile_occupancy(Level level, double ratio) const {
+    auto const& info = this->levels.at(level);
+    auto const& dir = this->_dir(level);
+    TissueMask mask{
+        ceil(info.shape[0], info.tile_shape[0]) / info.tile_shape[0],
+        dir.tiles_x,
+        std::vector<uint8_t>(dir.bytecounts.size())};
+    for (size_t i = 0; i < dir.bytecounts.size(); ++i)
+        mask.data[i] = dir.bytecounts[i]
+                       && !this->_is_sparse(info, dir.bytecounts[i], ratio);
+    return mask;
+}
+
+std::vector<uint8_t> TiffImage::state() const {
+    this->_dir(this->levels.begin()->first);
+    return sidecar::pack(this->_path, _index_kind, this->_index());
+}
+
+std::unique_ptr<Image> TiffImage::restore_this(
+    Path const& path, std::span<uint8_t const> state) {
+    if (auto r = sidecar::unpack(state, path, _index_kind))
+        try {
+            return _make_indexed(path, *r);
+        } catch (std::runtime_error const&) {
+        }
+    return {};
+}
+
+std::unique_ptr<Image>
+TiffImage::_make_indexed(Path const& path, sidecar::Reader r) {
+    auto info = r.get_info();
+
+    std::map<Level, Directory> dirs;
+    for (size_t i = 0; i < info.levels.size(); ++i) {
+        auto& dir = dirs[r.get<Level>()];
+        dir.compression = r.get<uint16_t>();
+        dir.photometric = r.get<uint16_t>();
+        dir.swapped = r.get<bool>();
+        dir.tiles_x = r.get<uint32_t>();
+        dir.offsets = r.get_vector<uint64_t>();
+        dir.bytecounts = r.get_vector<uint64_t>();
+        dir.jpeg_tables = r.get_vector<uint8_t>();
+    }
+    for (auto const& [level, _] : info.levels)
+        if (!dirs.count(level))
+            throw std::runtime_error{"Index is broken"};
+
+    return std::make_unique<TiffImage>(
+        path,
+        std::nullopt,
+        _try_map(path),
+        std::vector<ifd::Ifd>{},
+        std::move(dirs),
+        std::move(info.dtype),
+        std::move(info.samples),
+        std::move(info.levels),
+        std::move(info.spacing));
+}
+
+/// Builds ImageInfo from IFDs only. Tile tables, JPEG tables and libtiff
+/// handles wait until the first read.
+std::unique_ptr<Image> _make_lazy(
+    Path const& path, Mapping mapping, std::vector<ifd::Ifd> ifds) {
+    auto const& first = ifds.front();
+    auto descr = first.get_bytes(TIFFTAG_IMAGEDESCRIPTION);
+    _check_description(
+        {reinterpret_cast<char const*>(descr.data()), descr.size()});
+    if (!first.has(TIFFTAG_TILEWIDTH))
+        throw std::runtime_error{"Tiff is not tiled"};
+    if (first.get(TIFFTAG_PLANARCONFIG).value_or(PLANARCONFIG_CONTIG)
+        != PLANARCONFIG_CONTIG)
+        throw std::runtime_error{"Tiff is not contiguous"};
+
+    auto codec = first.get(TIFFTAG_COMPRESSION).value_or(COMPRESSION_NONE);
+    auto dtype = _get_dtype(
+        first.get(TIFFTAG_SAMPLEFORMAT).value_or(SAMPLEFORMAT_UINT),
+        first.get(TIFFTAG_BITSPERSAMPLE).value_or(1));
+    auto samples = _get_samples(
+        _get_photometric(first.get(TIFFTAG_PHOTOMETRIC)),
+        first.get(TIFFTAG_SAMPLESPERPIXEL).value_or(1),
+        codec);
+
+    std::map<Level, LevelInfo> levels;
+    for (size_t i = 0; i < ifds.size(); ++i) {
+        auto const& d = ifds[i];
+        if (!d.has(TIFFTAG_TILEWIDTH))
+            continue;
+        auto& info = levels[static_cast<Level>(i)];
+        info.shape
+            = {static_cast<Size>(d.get(TIFFTAG_IMAGELENGTH).value_or(0)),
+               static_cast<Size>(d.get(TIFFTAG_IMAGEWIDTH).value_or(0)),
+               samples};
+        info.tile_shape
+            = {static_cast<Size>(d.get(TIFFTAG_TILELENGTH).value_or(0)),
+               static_cast<Size>(d.get(TIFFTAG_TILEWIDTH).value_or(0)),
+               samples};
+
+        auto level_codec
+            = d.get(TIFFTAG_COMPRESSION).value_or(COMPRESSION_NONE);
+        std::span<uint8_t const> head;
+        if (level_codec == _TIFF_JPEG2K_YUV || level_codec == _TIFF_JPEG2K_RGB)
+            head = mapping.view(
+                d.get(TIFFTAG_TILEOFFSETS).value_or(0),
+                std::min<uint64_t>(
+                    d.get(TIFFTAG_TILEBYTECOUNTS).value_or(0), 1024));
+        info.reductions = _get_reductions(
+            info.tile_shape,
+            level_codec,
+            samples,
+            d.get(TIFFTAG_BITSPERSAMPLE).value_or(1),
+            head);
+    }
+    auto spacing = _get_spacing(
+        first.get_rational(TIFFTAG_YRESOLUTION),
+        first.get_rational(TIFFTAG_XRESOLUTION));
+
+    return std::make_unique<TiffImage>(
+        path,
+        std::nullopt,
+        std::move(mapping),
+        std::move(ifds),
+        std::map<Level, Directory>{},
+        std::move(dtype),
+        std::move(samples),
+        std::move(levels),
+        std::move(spacing));
 }
 
 std::unique_ptr<Image> TiffImage::make_this(Path const& path) {
+    if (auto index = sidecar::load(path))
+        if (auto r = sidecar::unpack(
+                index->view(0, index->size()), path, _index_kind))
+            try {
+                return _make_indexed(path, *r);
+            } catch (std::runtime_error const&) {
+            }
+
+    /// Fast path: walk IFD chain over mapping. Layouts which parser
+    /// doesn't handle are left to libtiff.
+    auto mapping = _try_map(path);
+    if (mapping) {
+        std::vector<ifd::Ifd> ifds;
+        try {
+            ifds = ifd::read_chain(mapping->view(0, mapping->size()));
+        } catch (std::runtime_error const&) {
+        }
+        if (!ifds.empty())
+            return _make_lazy(path, std::move(*mapping), std::move(ifds));
+    }
+
     auto file = File{path, "rm"};
     auto codec = file.get<uint16_t>(TIFFTAG_COMPRESSION);
 
-    if (codec == _TIFF_JPEG2K_YUV || codec == _TIFF_JPEG2K_RGB)
-        throw std::runtime_error{"JPEG2000 encoded tile is not yet supported"};
-
     auto c_descr = file.get_defaulted<char const*>(TIFFTAG_IMAGEDESCRIPTION);
-    if (c_descr) {
-        std::string descr{c_descr.value()};
-        if (descr.find("DICOM") != std::string::npos
-            || descr.find("xml") != std::string::npos
-            || descr.find("XML") != std::string::npos)
-            throw std::runtime_error{"Unsupported format: " + descr};
-    }
+    if (c_descr)
+        _check_description(c_descr.value());
     if (!TIFFIsTiled(file))
         throw std::runtime_error{"Tiff is not tiled"};
     if (file.get<uint16_t>(TIFFTAG_PLANARCONFIG) != PLANARCONFIG_CONTIG)
         throw std::runtime_error{"Tiff is not contiguous"};
 
-    auto dtype = _get_dtype(file);
-    auto samples = _get_samples(file);
-    auto levels = _read_pyramid(file, samples);
-    Spacing spacing = {
-        10000 / file.get<float>(TIFFTAG_YRESOLUTION),
-        10000 / file.get<float>(TIFFTAG_XRESOLUTION),
-    };
+    auto dtype = _get_dtype(
+        file.try_get<uint16_t>(TIFFTAG_SAMPLEFORMAT)
+            .value_or(SAMPLEFORMAT_UINT),
+        file.get<uint16_t>(TIFFTAG_BITSPERSAMPLE));
+    auto samples = _get_samples(
+        _get_photometric(file.try_get<uint16_t>(TIFFTAG_PHOTOMETRIC)),
+        file.get<uint16_t>(TIFFTAG_SAMPLESPERPIXEL),
+        codec);
+    auto [levels, dirs] = _read_pyramid(file, samples);
+    auto spacing = _get_spacing(
+        file.try_get<float>(TIFFTAG_YRESOLUTION),
+        file.try_get<float>(TIFFTAG_XRESOLUTION));
 
-    return std::make_unique<TiffImage>(
+    auto image = std::make_unique<TiffImage>(
+        path,
         std::move(file),
-        codec,
+        std::move(mapping),
+        std::vector<ifd::Ifd>{},
+        std::move(dirs),
         std::move(dtype),
         std::move(samples),
         std::move(levels),
         std::move(spacing));
+    image->_save_index();
+    return image;
 }
 
 } // namespace ts::tiff
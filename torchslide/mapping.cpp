@@ -0,0 +1,88 @@
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "core/traits.h"
+#include "mapping.h"
+
+namespace ts {
+
+#ifdef _WIN32
+
+Mapping::Mapping(Path const& path) {
+    auto file = CreateFileW(
+        path.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_RANDOM_ACCESS,
+        nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error{"Failed to open: " + path.generic_string()};
+    auto _file = make_owner(file, CloseHandle);
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || !size.QuadPart)
+        throw std::runtime_error{"Failed to map: " + path.generic_string()};
+
+    auto mapping
+        = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping)
+        throw std::runtime_error{"Failed to map: " + path.generic_string()};
+    auto _mapping = make_owner(mapping, CloseHandle);
+
+    auto ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!ptr)
+        throw std::runtime_error{"Failed to map: " + path.generic_string()};
+
+    _data = static_cast<uint8_t const*>(ptr);
+    _size = static_cast<size_t>(size.QuadPart);
+}
+
+Mapping::~Mapping() noexcept {
+    if (_data)
+        UnmapViewOfFile(_data);
+}
+
+#else
+
+Mapping::Mapping(Path const& path) {
+    auto fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error{"Failed to open: " + path.generic_string()};
+
+    struct stat st;
+    void* ptr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        throw std::runtime_error{"Failed to map: " + path.generic_string()};
+
+    _data = static_cast<uint8_t const*>(ptr);
+    _size = static_cast<size_t>(st.st_size);
+}
+
+Mapping::~Mapping() noexcept {
+    if (_data)
+        munmap(const_cast<uint8_t*>(_data), _size);
+}
+
+#endif
+
+Mapping::Mapping(Mapping&& other) noexcept
+  : _data{std::exchange(other._data, nullptr)}
+  , _size{std::exchange(other._size, 0)} { }
+
+} // namespace ts
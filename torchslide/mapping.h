@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+#include "core/factory.h"
+
+namespace ts {
+
+/// Read-only memory mapping of whole file
+struct Mapping {
+    Mapping(Path const& path);
+    Mapping(Mapping&& other) noexcept;
+    Mapping(Mapping const&) = delete;
+    ~Mapping() noexcept;
+
+    size_t size() const noexcept { return _size; }
+
+    /// Bytes at [offset, offset + size), empty if out of file bounds
+    std::span<uint8_t const> view(uint64_t offset, uint64_t size)
+        const noexcept {
+        if (offset > _size || size > _size - offset)
+            return {};
+        return {_data + offset, static_cast<size_t>(size)};
+    }
+
+private:
+    uint8_t const* _data = nullptr;
+    size_t _size = 0;
+};
+
+} // namespace ts
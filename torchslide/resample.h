@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+
+#include "core/box.h"
+#include "core/thread_pool.h"
+#include "tensor.h"
+
+namespace ts {
+
+namespace _detail {
+
+/// Area filter weights along single axis
+struct _AreaAxis {
+    /// First source pixel under each output one
+    std::vector<Size> first = {};
+    /// Range of weights of each output pixel, starting from `first`
+    std::vector<size_t> offsets = {0};
+    std::vector<float> weights = {};
+
+    _AreaAxis(Area const& area, size_t dim, Size size) {
+        auto const unit = area.unit;
+        for (Size i = 0; i < area.shape[dim]; ++i) {
+            auto lo = area.start[dim] + i * area.step[dim];
+            auto hi = std::clamp(lo + area.step[dim], Size{}, size * unit);
+            lo = std::clamp(lo, Size{}, size * unit);
+
+            /// Part of footprint beyond source counts as zeros
+            auto total = static_cast<float>(area.step[dim]);
+            this->first.push_back(lo / unit);
+            for (auto k = lo / unit; k * unit < hi; ++k) {
+                auto overlap
+                    = std::min(hi, (k + 1) * unit) - std::max(lo, k * unit);
+                this->weights.push_back(static_cast<float>(overlap) / total);
+            }
+            this->offsets.push_back(this->weights.size());
+        }
+    }
+};
+
+template <typename T, typename Acc>
+constexpr T _round(Acc value) noexcept {
+    if constexpr (std::is_integral_v<T>)
+        return static_cast<T>(value + Acc{0.5});
+    else
+        return static_cast<T>(value);
+}
+
+} // namespace _detail
+
+/// Downsamples `src` of (H, W, C) shape to `out` of (h, w, C) shape
+/// with area (box) filter: each output pixel is a mean of source ones
+/// under its footprint, weighted by overlap.
+/// Rows are accumulated first over contiguous memory, so compiler
+/// vectorizes the hot loop for whatever SIMD target it builds for.
+template <typename T>
+void resize_area(Tensor<T> const& src, Tensor<T>& out, Area const& area) {
+    using Acc = std::conditional_t<(sizeof(T) < 4), float, double>;
+
+    auto const& shape = *src.shape();
+    auto const samples = shape[2];
+    auto const row = shape[1] * samples;
+    _detail::_AreaAxis const ys{area, 0, shape[0]};
+    _detail::_AreaAxis const xs{area, 1, shape[1]};
+
+    thread_pool().parallel_for(area.shape[0], [&](size_t i) {
+        thread_local std::vector<Acc> acc;
+        acc.assign(row, Acc{});
+
+        auto const* s = src.data() + ys.first[i] * row;
+        for (auto k = ys.offsets[i]; k < ys.offsets[i + 1]; ++k, s += row) {
+            auto const w = static_cast<Acc>(ys.weights[k]);
+            for (Size j = 0; j < row; ++j)
+                acc[j] += w * static_cast<Acc>(s[j]);
+        }
+
+        auto* o = out.data() + i * area.shape[1] * samples;
+        for (Size x = 0; x < area.shape[1]; ++x, o += samples) {
+            auto const* a = acc.data() + xs.first[x] * samples;
+            for (Size c = 0; c < samples; ++c) {
+                auto value = Acc{};
+                for (auto k = xs.offsets[x]; k < xs.offsets[x + 1]; ++k)
+                    value += static_cast<Acc>(xs.weights[k])
+                             * a[(k - xs.offsets[x]) * samples + c];
+                o[c] = _detail::_round<T>(value);
+            }
+        }
+    });
+}
+
+} // namespace ts
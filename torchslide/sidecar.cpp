@@ -0,0 +1,203 @@
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+
+#include "sidecar.h"
+
+namespace ts::sidecar {
+
+namespace {
+
+/// Bumped on each change of layout
+constexpr char _magic[8] = {'T', 'S', 'I', 'D', 'X', 0, 0, 1};
+
+std::mutex _mutex;
+
+Path& _dir() {
+    static Path dir = [] {
+        auto env = std::getenv("TORCHSLIDE_INDEX_DIR");
+        return env ? Path{env} : Path{};
+    }();
+    return dir;
+}
+
+/// Size, mtime and absolute path of slide, as written in header
+struct Key {
+    uint64_t size;
+    int64_t mtime;
+    std::string path;
+};
+
+std::optional<Key> _key(Path const& path) noexcept {
+    std::error_code ec;
+    auto abs = std::filesystem::absolute(path, ec);
+    if (ec)
+        return {};
+    auto size = std::filesystem::file_size(path, ec);
+    if (ec)
+        return {};
+    auto mtime = std::filesystem::last_write_time(path, ec);
+    if (ec)
+        return {};
+    return Key{
+        size,
+        static_cast<int64_t>(mtime.time_since_epoch().count()),
+        abs.generic_string()};
+}
+
+/// Location of index for slide, empty if indexing is off
+Path _index_path(Key const& key) {
+    auto dir = get_dir();
+    if (dir.empty())
+        return {};
+    char name[32];
+    std::snprintf(
+        name,
+        sizeof(name),
+        "%016llx.tsidx",
+        static_cast<unsigned long long>(std::hash<std::string>{}(key.path)));
+    return dir / name;
+}
+
+void _put_header(Writer& w, uint32_t kind, Key const& key) {
+    w.put(_magic);
+    w.put(kind);
+    w.put(key.size);
+    w.put(key.mtime);
+    w.put(std::vector<char>(key.path.begin(), key.path.end()));
+}
+
+bool _check_header(Reader& r, uint32_t kind, Key const& key) {
+    auto magic = r.get<std::array<char, sizeof(_magic)>>();
+    if (std::memcmp(magic.data(), _magic, sizeof(_magic)))
+        return false;
+    if (r.get<uint32_t>() != kind || r.get<uint64_t>() != key.size
+        || r.get<int64_t>() != key.mtime)
+        return false;
+    auto path = r.get_vector<char>();
+    return std::string_view{path.data(), path.size()} == key.path;
+}
+
+} // namespace
+
+void set_dir(Path const& dir) {
+    if (!dir.empty())
+        std::filesystem::create_directories(dir);
+    std::unique_lock lk{_mutex};
+    _dir() = dir;
+}
+
+Path get_dir() {
+    std::unique_lock lk{_mutex};
+    return _dir();
+}
+
+// ---------------------------- ImageInfo layout ----------------------------
+
+void Writer::put(ImageInfo const& info) {
+    this->put(static_cast<uint8_t>(info.dtype.index()));
+    this->put(info.samples);
+    this->put(info.spacing);
+    this->put(static_cast<uint64_t>(info.levels.size()));
+    for (auto const& [level, li] : info.levels) {
+        this->put(level);
+        this->put(li.shape);
+        this->put(li.tile_shape);
+        this->put(li.reductions);
+    }
+}
+
+ImageInfo Reader::get_info() {
+    auto index = this->get<uint8_t>();
+    auto dtype = make_variant_if(
+        [index, i = size_t{0}](auto) mutable { return i++ == index; },
+        DType{});
+    if (!dtype)
+        throw std::runtime_error{"Index is broken"};
+
+    ImageInfo info{*dtype, this->get<Size>(), {}, {}};
+    info.spacing = this->get<Spacing>();
+    for (auto count = this->get<uint64_t>(); count; --count) {
+        auto& li = info.levels[this->get<Level>()];
+        li.shape = this->get<Shape>();
+        li.tile_shape = this->get<Shape>();
+        li.reductions = this->get<uint8_t>();
+    }
+    return info;
+}
+
+// ---------------------------- packing & files ----------------------------
+
+std::vector<uint8_t>
+pack(Path const& path, uint32_t kind, Writer const& body) {
+    auto key = _key(path);
+    if (!key)
+        return {};
+    Writer w;
+    _put_header(w, kind, *key);
+    w.data.insert(w.data.end(), body.data.begin(), body.data.end());
+    return std::move(w.data);
+}
+
+std::optional<Reader> unpack(
+    std::span<uint8_t const> data, Path const& path, uint32_t kind) noexcept {
+    auto key = _key(path);
+    if (!key)
+        return {};
+    try {
+        Reader r{data};
+        if (_check_header(r, kind, *key))
+            return r;
+    } catch (std::exception const&) {
+    }
+    return {};
+}
+
+std::optional<Mapping> load(Path const& path) noexcept {
+    try {
+        auto key = _key(path);
+        if (!key)
+            return {};
+        auto index_path = _index_path(*key);
+        std::error_code ec;
+        if (index_path.empty() || !std::filesystem::exists(index_path, ec))
+            return {};
+        return Mapping{index_path};
+    } catch (std::exception const&) {
+        return {};
+    }
+}
+
+void save(Path const& path, std::vector<uint8_t> const& index) noexcept {
+    auto key = _key(path);
+    if (!key || index.empty())
+        return;
+    try {
+        auto index_path = _index_path(*key);
+        if (index_path.empty())
+            return;
+
+        auto tmp = index_path;
+        tmp += "." + std::to_string(std::random_device{}()) + ".tmp";
+        {
+            std::ofstream f{tmp, std::ios::binary | std::ios::trunc};
+            f.write(reinterpret_cast<char const*>(index.data()),
+                    static_cast<std::streamsize>(index.size()));
+            if (!f)
+                throw std::runtime_error{"Failed to write index"};
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmp, index_path, ec);
+        if (ec)
+            std::filesystem::remove(tmp, ec);
+    } catch (std::exception const&) {
+    }
+}
+
+} // namespace ts::sidecar
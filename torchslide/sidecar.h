@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstring>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "core/factory.h"
+#include "image.h"
+#include "mapping.h"
+
+namespace ts::sidecar {
+
+/// Binary index of slide's metadata and tile tables, so repeated opens
+/// of the same file (i.e. by every DataLoader worker) skip its parsing.
+/// Index is valid while slide's size and mtime are the same.
+
+/// Sets directory for indices, empty path disables them.
+/// Initially taken from `TORCHSLIDE_INDEX_DIR` environment variable.
+void set_dir(Path const& dir);
+Path get_dir();
+
+/// Appends native-endian values, index is never moved across machines
+struct Writer {
+    std::vector<uint8_t> data = {};
+
+    template <typename T>
+    void put(T const& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        auto ptr = reinterpret_cast<uint8_t const*>(&value);
+        data.insert(data.end(), ptr, ptr + sizeof(T));
+    }
+
+    template <typename T>
+    void put(std::vector<T> const& values) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        this->put(static_cast<uint64_t>(values.size()));
+        auto ptr = reinterpret_cast<uint8_t const*>(values.data());
+        data.insert(data.end(), ptr, ptr + values.size() * sizeof(T));
+    }
+
+    void put(ImageInfo const& info);
+};
+
+/// Reads values back in the same order, throws on truncated index
+struct Reader {
+    std::span<uint8_t const> data;
+    size_t pos = 0;
+
+    template <typename T>
+    T get() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        std::memcpy(&value, this->_take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    std::vector<T> get_vector() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        auto size = this->get<uint64_t>();
+        if (size > (data.size() - pos) / sizeof(T))
+            throw std::runtime_error{"Index is broken"};
+        std::vector<T> values(static_cast<size_t>(size));
+        std::memcpy(values.data(), this->_take(size * sizeof(T)),
+                    values.size() * sizeof(T));
+        return values;
+    }
+
+    ImageInfo get_info();
+
+private:
+    uint8_t const* _take(size_t size) {
+        if (size > data.size() - pos)
+            throw std::runtime_error{"Index is broken"};
+        auto ptr = data.data() + pos;
+        pos += size;
+        return ptr;
+    }
+};
+
+/// Prepends header to `body`, so it's valid only for current state
+/// of `path`. `kind` tells apart formats of different readers.
+/// Empty if `path` can't be stat'ed.
+std::vector<uint8_t> pack(Path const& path, uint32_t kind, Writer const& body);
+
+/// Body of index `data`, if it was packed for current state of `path`
+std::optional<Reader> unpack(
+    std::span<uint8_t const> data, Path const& path, uint32_t kind) noexcept;
+
+/// Mapped index of `path` from index directory, if any
+std::optional<Mapping> load(Path const& path) noexcept;
+
+/// Writes index of `path` via rename of temporary file, so concurrent
+/// writers and readers never see partial one. Failures are ignored.
+void save(Path const& path, std::vector<uint8_t> const& index) noexcept;
+
+} // namespace ts::sidecar
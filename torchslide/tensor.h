@@ -3,6 +3,7 @@
 #include <cassert>
 #include <numeric>
 #include <utility>
+#include <variant>
 
 #include "core/view.h"
 #include "core/std.h"
@@ -34,6 +35,7 @@ struct Tensor {
 
     ShapeAny _shape;
     _Storage _data = {};
+    T* _external = nullptr;
 
     Tensor(ShapeAny shape) : _shape{std::move(shape)} {
         _data.resize(_detail::_to_size(_shape));
@@ -42,14 +44,26 @@ struct Tensor {
         : _shape{std::move(shape)}, _data{std::move(data)}
     {}
 
+    /// Non-owning tensor over external buffer (i.e. NumPy-owned or pinned).
+    /// Buffer must be C-contiguous and outlive the tensor.
+    Tensor(ShapeAny shape, T* external) noexcept
+        : _shape{std::move(shape)}, _external{external}
+    {}
+
+    bool owns() const noexcept { return !this->_external; }
+
     auto const& shape() const& noexcept { return this->_shape; }
-    auto&& shape() && noexcept { return this->_shape; }
+    ShapeAny&& shape() && noexcept { return std::move(this->_shape); }
 
     auto const& storage() const& noexcept { return this->_data; }
-    auto&& storage() && noexcept { return this->_data; }
+    _Storage&& storage() && noexcept { return std::move(this->_data); }
 
-    T const* data() const noexcept { return this->_data.data(); }
-    T* data() noexcept { return this->_data.data(); }
+    T const* data() const noexcept {
+        return this->_external ? this->_external : this->_data.data();
+    }
+    T* data() noexcept {
+        return this->_external ? this->_external : this->_data.data();
+    }
 
     template <size_t N>
     _View<T const, N> view() const& noexcept {
@@ -70,4 +84,28 @@ struct Tensor {
     }
 };
 
+template <typename T>
+size_t nbytes(Tensor<T> const& t) noexcept {
+    return t.storage().size() * sizeof(T);
+}
+
+namespace _detail {
+
+template <typename V>
+struct _tensor_of;
+
+template <typename... Ts>
+struct _tensor_of<std::variant<Ts...>> {
+    using type = std::variant<Tensor<Ts>...>;
+};
+
+} // namespace _detail
+
+/// Tensor of any type from `DType`
+using AnyTensor = typename _detail::_tensor_of<DType>::type;
+
+inline size_t nbytes(AnyTensor const& t) noexcept {
+    return std::visit([](auto const& v) { return nbytes(v); }, t);
+}
+
 } // namespace ts
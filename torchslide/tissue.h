@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <type_traits>
+#include <vector>
+
+#include "core/std.h"
+#include "tensor.h"
+
+namespace ts {
+
+/// Longer side of image resolution at which tissue is found
+constexpr Size tissue_side = 1024;
+
+/// Low resolution (h, w) mask of image foreground, row-major 0/1.
+/// Queried in coordinates of image of (H, W) shape.
+struct TissueMask {
+    Size h = 0;
+    Size w = 0;
+    std::vector<uint8_t> data = {};
+
+    bool empty() const noexcept { return data.empty(); }
+
+    /// Whether point (y, x) is foreground
+    bool at(Size y, Size x, Size H, Size W) const noexcept {
+        auto my = std::clamp(y * h / H, Size{}, h - 1);
+        auto mx = std::clamp(x * w / W, Size{}, w - 1);
+        return data[static_cast<size_t>(my * w + mx)];
+    }
+
+    /// Whether any foreground is under [y0, y1) x [x0, x1)
+    bool any(Size y0, Size x0, Size y1, Size x1, Size H, Size W)
+        const noexcept {
+        auto my0 = std::clamp(y0 * h / H, Size{}, h);
+        auto mx0 = std::clamp(x0 * w / W, Size{}, w);
+        auto my1 = std::clamp(ceil(y1 * h, H) / H, Size{}, h);
+        auto mx1 = std::clamp(ceil(x1 * w, W) / W, Size{}, w);
+        for (auto my = my0; my < my1; ++my)
+            for (auto mx = mx0; mx < mx1; ++mx)
+                if (data[static_cast<size_t>(my * w + mx)])
+                    return true;
+        return false;
+    }
+};
+
+namespace _detail {
+
+/// Least saturation (darkness if single-channel) counted as tissue,
+/// so noise of blank glass is never split by Otsu's threshold
+constexpr float _min_level = 0.08f;
+
+/// Bin of 256-bin histogram maximizing between-class variance
+inline size_t _otsu(std::array<size_t, 256> const& hist) noexcept {
+    double total = 0, sum = 0;
+    for (size_t i = 0; i < hist.size(); ++i) {
+        total += static_cast<double>(hist[i]);
+        sum += static_cast<double>(i * hist[i]);
+    }
+    double count_lo = 0, sum_lo = 0, best = -1;
+    size_t threshold = 0;
+    for (size_t i = 0; i < hist.size(); ++i) {
+        count_lo += static_cast<double>(hist[i]);
+        sum_lo += static_cast<double>(i * hist[i]);
+        auto count_hi = total - count_lo;
+        if (!count_lo || !count_hi)
+            continue;
+        auto diff = sum_lo / count_lo - (sum - sum_lo) / count_hi;
+        auto var = count_lo * count_hi * diff * diff;
+        if (var > best) {
+            best = var;
+            threshold = i;
+        }
+    }
+    return threshold;
+}
+
+} // namespace _detail
+
+/// Finds foreground of (H, W, C) image. Glass is bright and gray, so
+/// pixels are binned by HSV saturation (by darkness if single-channel)
+/// and split with Otsu's threshold, but never below `_min_level`.
+/// Uniform image has no foreground.
+template <typename T>
+TissueMask find_tissue(Tensor<T> const& image) {
+    auto const& shape = *image.shape();
+    auto const h = shape[0], w = shape[1], c = shape[2];
+    auto const pixels = static_cast<size_t>(h * w);
+    auto const src = image.data();
+
+    float vmax = 0;
+    if (c == 1)
+        for (size_t i = 0; i < pixels; ++i)
+            vmax = std::max(vmax, static_cast<float>(src[i]));
+
+    std::vector<uint8_t> bins(pixels);
+    std::array<size_t, 256> hist = {};
+    for (size_t i = 0; i < pixels; ++i) {
+        auto px = src + i * static_cast<size_t>(c);
+        float level = 0;
+        if (c == 1) {
+            level = vmax > 0 ? 1 - static_cast<float>(px[0]) / vmax : 0;
+        } else {
+            auto [lo, hi] = std::minmax(
+                {static_cast<float>(px[0]),
+                 static_cast<float>(px[1]),
+                 static_cast<float>(px[2])});
+            level = hi > 0 ? (hi - lo) / hi : 0;
+        }
+        auto bin = static_cast<uint8_t>(std::clamp(level * 256, 0.f, 255.f));
+        bins[i] = bin;
+        ++hist[bin];
+    }
+
+    auto const threshold = std::max(
+        _detail::_otsu(hist), static_cast<size_t>(_detail::_min_level * 256));
+    TissueMask mask{h, w, std::vector<uint8_t>(pixels)};
+    for (size_t i = 0; i < pixels; ++i)
+        mask.data[i] = bins[i] > threshold;
+    if (std::count(hist.begin(), hist.end(), 0) == 255)
+        std::fill(mask.data.begin(), mask.data.end(), 0);
+    return mask;
+}
+
+} // namespace ts